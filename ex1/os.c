@@ -4,15 +4,54 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 #include <sys/mman.h>
+#include <threads.h>
 
 #include "os.h"
 
 /* 2^20 pages ought to be enough for anybody */
 #define NPAGES	(1024*1024)
 
+#ifdef FRAME_ARENA
+/*
+ * All frames are carved out of one region reserved up front, so phys_to_virt()
+ * is an offset instead of a table lookup. Only the frames that get touched are
+ * backed by memory. Build with -DFRAME_ARENA_HUGETLB to back the region with
+ * explicit huge pages, otherwise transparent huge pages are asked for.
+ */
+#define ARENA_BASE	(0xbaaaaaadULL << 12)
+#define ARENA_SIZE	((uint64_t)NPAGES * 4096)
+
+static char* arena;
+
+static void arena_init(void)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+#ifdef FRAME_ARENA_HUGETLB
+	/* without MAP_NORESERVE this fails up front instead of faulting later */
+	arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (arena != MAP_FAILED)
+		return;
+	warnx("no huge pages for the frame arena, falling back to 4 KiB pages");
+#endif
+	arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (arena == MAP_FAILED)
+		err(1, "mmap failed");
+	madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+}
+#else
 static char* pages[NPAGES];
+#endif
+
+/* the page table may allocate and free from several threads at once */
+static mtx_t frame_lock;
+
+/* frames handed back by free_page_frame(), linked through their first word */
+static uint64_t free_frames = NO_MAPPING;
 
 uint64_t alloc_page_frame(void)
 {
@@ -20,6 +59,16 @@ uint64_t alloc_page_frame(void)
 	uint64_t ppn;
 	void* va;
 
+	mtx_lock(&frame_lock);
+	if (free_frames != NO_MAPPING) {
+		ppn = free_frames;
+		va = phys_to_virt(ppn << 12);
+		free_frames = *(uint64_t*)va;
+		mtx_unlock(&frame_lock);
+		memset(va, 0, 4096);
+		return ppn;
+	}
+
 	if (nalloc == NPAGES)
 		errx(1, "out of physical memory");
 
@@ -27,16 +76,27 @@ uint64_t alloc_page_frame(void)
 	ppn = nalloc;
 	nalloc++;
 
+#ifdef FRAME_ARENA
+	if (arena == NULL)
+		arena_init();
+#else
 	va = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 	if (va == MAP_FAILED)
 		err(1, "mmap failed");
 
 	pages[ppn] = va;
+#endif
+	mtx_unlock(&frame_lock);
 	return ppn + 0xbaaaaaad;
 }
 
 void* phys_to_virt(uint64_t phys_addr)
 {
+#ifdef FRAME_ARENA
+	uint64_t off = phys_addr - ARENA_BASE;
+
+	return off < ARENA_SIZE ? arena + off : NULL;
+#else
 	uint64_t ppn = (phys_addr >> 12) - 0xbaaaaaad;
 	uint64_t off = phys_addr & 0xfff;
 	char* va = NULL;
@@ -45,11 +105,25 @@ void* phys_to_virt(uint64_t phys_addr)
 		va = pages[ppn] + off;
 
 	return va;
+#endif
+}
+
+void free_page_frame(uint64_t ppn)
+{
+	uint64_t* frame = phys_to_virt(ppn << 12);
+
+	mtx_lock(&frame_lock);
+	*frame = free_frames;
+	free_frames = ppn;
+	mtx_unlock(&frame_lock);
 }
 
 int main(int argc, char **argv)
 {
-	uint64_t pt = alloc_page_frame();
+	uint64_t pt;
+
+	mtx_init(&frame_lock, mtx_plain);
+	pt = alloc_page_frame();
 
 	assert(page_table_query(pt, 0xcafecafeeee) == NO_MAPPING);
 	assert(page_table_query(pt, 0xfffecafeeee) == NO_MAPPING);
@@ -1,12 +1,71 @@
-
 #include <stdint.h>
 
 #define NO_MAPPING	(~0ULL)
 
+/* Shape of the page table: PT_LEVELS levels of 2^PT_BITS entries each, so VPNs have
+ * PT_LEVELS * PT_BITS bits. Override both with -D for pt.c and its callers alike.
+ * A table is one frame, so PT_BITS is 2 to 9. */
+#ifndef PT_LEVELS
+#define PT_LEVELS	5
+#endif
+#ifndef PT_BITS
+#define PT_BITS		9
+#endif
+
+/* Must be thread-safe when several threads update the same page table */
 uint64_t alloc_page_frame(void);
+void free_page_frame(uint64_t ppn);
 void* phys_to_virt(uint64_t phys_addr);
 
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
 uint64_t page_table_query(uint64_t pt, uint64_t vpn);
 
+/* Batched variants that only re-walk the levels whose index changes */
+void page_table_update_range(uint64_t pt, uint64_t vpn_start, uint64_t count, uint64_t ppn_start);
+void page_table_query_batch(uint64_t pt, const uint64_t* vpns, uint64_t* out, uint64_t n);
+
+/* Optional software TLB in front of page_table_query(), off by default.
+ * Each thread has its own TLB, and the stats count the calling thread's lookups. */
+void page_table_tlb_enable(int enable);
+void page_table_tlb_flush(void);
+void page_table_tlb_invalidate(uint64_t pt, uint64_t vpn);
+void page_table_tlb_stats(uint64_t* hits, uint64_t* misses);
+
+/* Optional per-thread cache of the tables queries walk through, off by default.
+ * Bit n of levels caches the tables at level n (1 to PT_LEVELS - 1, the last level
+ * holds the leaves), so 1 << (PT_LEVELS - 1) caches one last level table per region
+ * of 2^PT_BITS pages (2 MiB with the default shape). The stats count the calling
+ * thread's lookups that resumed at (hits) or went past (misses) the given level. */
+void page_table_psc_enable(unsigned levels);
+void page_table_psc_flush(void);
+void page_table_psc_stats(int level, uint64_t* hits, uint64_t* misses);
+
+/* Copy-on-write clone that shares every table below the root with pt, and a call to
+ * free a page table with every table only it uses, root included. pt must not be
+ * updated while it is cloned. */
+uint64_t page_table_clone(uint64_t pt);
+void page_table_destroy(uint64_t pt);
+
+/* Calls cb(vpn, ppn, count, arg) for every run of count pages mapped at vpn -> ppn
+ * in [vpn_lo, vpn_hi), in VPN order, skipping unmapped subtrees. A nonzero return
+ * from cb stops the scan and is returned. */
+typedef int (*page_table_cb)(uint64_t vpn, uint64_t ppn, uint64_t count, void* arg);
+int page_table_for_each(uint64_t pt, uint64_t vpn_lo, uint64_t vpn_hi, page_table_cb cb, void* arg);
+
+/* Caps the vectorized table kernels at level: 0 plain loops, 1 SSE2, 2 AVX2, or -1
+ * for the best the CPU supports (the default). Returns the level in use. */
+int page_table_simd(int level);
+
+/* The hashed page table of pt_hash.c, under its own names so it can be linked next
+ * to pt.c. pt_hash.c built with -DPT_HASHED provides page_table_update() and
+ * page_table_query() instead, in place of pt.c. */
+void hpt_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
+uint64_t hpt_query(uint64_t pt, uint64_t vpn);
+void hpt_destroy(uint64_t pt);
+
+/* Snapshots of every mapping as sorted (vpn, ppn, count) runs. page_table_save()
+ * returns 0 or -1, page_table_load() the root of a new page table or NO_MAPPING,
+ * both with errno set on failure. */
+int page_table_save(uint64_t pt, const char* path);
+uint64_t page_table_load(const char* path);
 
@@ -4,17 +4,59 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 #include <sys/mman.h>
+#include <stdatomic.h>
+#include <threads.h>
 
 #include "os.h"
 
-
+#if PT_LEVELS != 5 || PT_BITS != 9
+#error "the tests expect the default page table shape of 5 levels of 9 bits"
+#endif
 
 /* 2^20 pages ought to be enough for anybody */
 #define NPAGES (1024 * 1024)
 
+#ifdef FRAME_ARENA
+/*
+ * All frames are carved out of one region reserved up front, so phys_to_virt()
+ * is an offset instead of a table lookup. Only the frames that get touched are
+ * backed by memory. Build with -DFRAME_ARENA_HUGETLB to back the region with
+ * explicit huge pages, otherwise transparent huge pages are asked for.
+ */
+#define ARENA_BASE	(0xbaaaaaadULL << 12)
+#define ARENA_SIZE	((uint64_t)NPAGES * 4096)
+
+static char *arena;
+
+static void arena_init(void)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+#ifdef FRAME_ARENA_HUGETLB
+	/* without MAP_NORESERVE this fails up front instead of faulting later */
+	arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (arena != MAP_FAILED)
+		return;
+	warnx("no huge pages for the frame arena, falling back to 4 KiB pages");
+#endif
+	arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (arena == MAP_FAILED)
+		err(1, "mmap failed");
+	madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+}
+#else
 static char *pages[NPAGES];
+#endif
+
+/* the page table may allocate and free from several threads at once */
+static mtx_t frame_lock;
+
+/* frames handed back by free_page_frame(), linked through their first word */
+static uint64_t free_frames = NO_MAPPING;
 
 uint64_t alloc_page_frame(void)
 {
@@ -22,6 +64,16 @@ uint64_t alloc_page_frame(void)
 	uint64_t ppn;
 	void *va;
 
+	mtx_lock(&frame_lock);
+	if (free_frames != NO_MAPPING) {
+		ppn = free_frames;
+		va = phys_to_virt(ppn << 12);
+		free_frames = *(uint64_t *)va;
+		mtx_unlock(&frame_lock);
+		memset(va, 0, 4096);
+		return ppn;
+	}
+
 	if (nalloc == NPAGES)
 		errx(1, "out of physical memory");
 
@@ -29,16 +81,27 @@ uint64_t alloc_page_frame(void)
 	ppn = nalloc;
 	nalloc++;
 
+#ifdef FRAME_ARENA
+	if (arena == NULL)
+		arena_init();
+#else
 	va = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	if (va == MAP_FAILED)
 		err(1, "mmap failed");
 
 	pages[ppn] = va;
+#endif
+	mtx_unlock(&frame_lock);
 	return ppn + 0xbaaaaaad;
 }
 
 void *phys_to_virt(uint64_t phys_addr)
 {
+#ifdef FRAME_ARENA
+	uint64_t off = phys_addr - ARENA_BASE;
+
+	return off < ARENA_SIZE ? arena + off : NULL;
+#else
 	uint64_t ppn = (phys_addr >> 12) - 0xbaaaaaad;
 	uint64_t off = phys_addr & 0xfff;
 	char *va = NULL;
@@ -47,12 +110,104 @@ void *phys_to_virt(uint64_t phys_addr)
 		va = pages[ppn] + off;
 
 	return va;
+#endif
+}
+
+void free_page_frame(uint64_t ppn)
+{
+	uint64_t *frame = phys_to_virt(ppn << 12);
+
+	mtx_lock(&frame_lock);
+	*frame = free_frames;
+	free_frames = ppn;
+	mtx_unlock(&frame_lock);
+}
+
+
+/* index of vpn in a table at the given level of the 5 level trie */
+static int levelIndex(uint64_t vpn, int level)
+{
+	return (vpn >> ((4 - level) * 9)) & 0x1ff;
 }
 
+/* page_table_for_each() callback that records the runs it is handed */
+struct scan {
+	uint64_t runs[8][3];
+	int n;
+	int stop_at;
+};
+
+static int record_run(uint64_t vpn, uint64_t ppn, uint64_t count, void *arg)
+{
+	struct scan *scan = arg;
+
+	assert(scan->n < 8);
+	scan->runs[scan->n][0] = vpn;
+	scan->runs[scan->n][1] = ppn;
+	scan->runs[scan->n][2] = count;
+	scan->n++;
+	return scan->n == scan->stop_at ? 42 : 0;
+}
+
+static int count_pages(uint64_t vpn, uint64_t ppn, uint64_t count, void *arg)
+{
+	(void)vpn;
+	(void)ppn;
+	*(uint64_t *)arg += count;
+	return 0;
+}
+
+/* page_table_for_each() callback that unmaps the runs it is handed */
+struct unmap {
+	uint64_t pt;
+	uint64_t free_frames;	/* the free list when the scan started */
+	int n;
+};
+
+static int unmap_run(uint64_t vpn, uint64_t ppn, uint64_t count, void *arg)
+{
+	struct unmap *unmap = arg;
+
+	assert(page_table_query(unmap->pt, vpn) == ppn);
+	page_table_update_range(unmap->pt, vpn, count, NO_MAPPING);
+	assert(page_table_query(unmap->pt, vpn) == NO_MAPPING);
+	/* the scan still walks the unlinked tables, they must not be freed yet */
+	assert(free_frames == unmap->free_frames);
+	unmap->n++;
+	return 0;
+}
+
+/* more threads than pt.c has epoch slots for, mapping and unmapping their own tables */
+#define MANY_THREADS 300
+
+static uint64_t many_pt;
+static atomic_int many_started;
+
+static int many_thread(void *arg)
+{
+	uint64_t vpn = ((uintptr_t)arg + 1) << 9;
+
+	page_table_update(many_pt, vpn, vpn);
+	atomic_fetch_add(&many_started, 1);
+	/* every thread holds a slot, or shares the last one, before any unmaps */
+	while (atomic_load(&many_started) < MANY_THREADS)
+		thrd_yield();
+	for (int i = 0; i < 50; i++) {
+		assert(page_table_query(many_pt, vpn) == vpn);
+		page_table_update(many_pt, vpn, NO_MAPPING);
+		assert(page_table_query(many_pt, vpn) == NO_MAPPING);
+		page_table_update(many_pt, vpn, vpn);
+	}
+	page_table_update(many_pt, vpn, NO_MAPPING);
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
-	uint64_t pt = alloc_page_frame();
+	uint64_t pt;
+
+	mtx_init(&frame_lock, mtx_plain);
+	pt = alloc_page_frame();
 	assert(page_table_query(pt, 0xcafecafeeee) == NO_MAPPING);
 	assert(page_table_query(pt, 0xfffecafeeee) == NO_MAPPING);
 	assert(page_table_query(pt, 0xcafecafeeff) == NO_MAPPING);
@@ -253,6 +408,317 @@ int main(int argc, char **argv)
 	page_table_update(new_pt, 0xabc, NO_MAPPING);
 	printf("zero_not_node_root_Test: PASSED\n");
 
+	// tlb_invalidation_test
+	{
+		uint64_t hits, misses;
+
+		pt = alloc_page_frame();
+		page_table_tlb_enable(1);
+		page_table_update(pt, 0xabc, 0x123);
+		assert(page_table_query(pt, 0xabc) == 0x123);
+		assert(page_table_query(pt, 0xabc) == 0x123);
+		page_table_tlb_stats(&hits, &misses);
+		assert(hits >= 1);
+		page_table_update(pt, 0xabc, 0x456);
+		assert(page_table_query(pt, 0xabc) == 0x456);
+		page_table_update(pt, 0xabc, NO_MAPPING);
+		assert(page_table_query(pt, 0xabc) == NO_MAPPING);
+		page_table_tlb_enable(0);
+		printf("tlb_invalidation_test: PASSED\n");
+	}
+
+	// update_range_and_query_batch_test
+	{
+		uint64_t vpns[] = {0x1fe, 0x1ff, 0x200, 0x201, 0x5000, 0x1ffff8000000};
+		uint64_t out[sizeof(vpns) / sizeof(vpns[0])];
+
+		pt = alloc_page_frame();
+		page_table_update_range(pt, 0x100, 0x200, 0x7000);
+		assert(page_table_query(pt, 0xff) == NO_MAPPING);
+		assert(page_table_query(pt, 0x100) == 0x7000);
+		assert(page_table_query(pt, 0x2ff) == 0x71ff);
+		assert(page_table_query(pt, 0x300) == NO_MAPPING);
+		page_table_query_batch(pt, vpns, out, sizeof(vpns) / sizeof(vpns[0]));
+		assert(out[0] == 0x70fe && out[1] == 0x70ff && out[2] == 0x7100 && out[3] == 0x7101);
+		assert(out[4] == NO_MAPPING && out[5] == NO_MAPPING);
+		page_table_update_range(pt, 0x1ff, 2, NO_MAPPING);
+		assert(page_table_query(pt, 0x1fe) == 0x70fe);
+		assert(page_table_query(pt, 0x1ff) == NO_MAPPING);
+		assert(page_table_query(pt, 0x200) == NO_MAPPING);
+		assert(page_table_query(pt, 0x201) == 0x7101);
+		printf("update_range_and_query_batch_test: PASSED\n");
+	}
+
+	// huge_page_test
+	pt = alloc_page_frame();
+	page_table_update_range(pt, 0x40000, 0x40000 + 0x400, 0x80000);
+	assert(page_table_query(pt, 0x3ffff) == NO_MAPPING);
+	assert(page_table_query(pt, 0x40000) == 0x80000);
+	assert(page_table_query(pt, 0x5abcd) == 0x9abcd);
+	assert(page_table_query(pt, 0x803ff) == 0xc03ff);
+	assert(page_table_query(pt, 0x80400) == NO_MAPPING);
+	tmp = phys_to_virt(pt << 12);
+	tmp = phys_to_virt((tmp[0] >> 12) << 12);
+	tmp = phys_to_virt((tmp[0] >> 12) << 12);
+	assert((tmp[1] & 3) == 3);
+	// a 4 KiB update splits the 1 GiB leaf into 2 MiB leaves and one 4 KiB table
+	page_table_update(pt, 0x5abcd, 0x1234);
+	assert(page_table_query(pt, 0x5abcd) == 0x1234);
+	assert(page_table_query(pt, 0x5abcc) == 0x9abcc);
+	assert(page_table_query(pt, 0x5abce) == 0x9abce);
+	assert(page_table_query(pt, 0x5ac00) == 0x9ac00);
+	assert(page_table_query(pt, 0x7ffff) == 0xbffff);
+	page_table_update(pt, 0x40001, NO_MAPPING);
+	assert(page_table_query(pt, 0x40000) == 0x80000);
+	assert(page_table_query(pt, 0x40001) == NO_MAPPING);
+	assert(page_table_query(pt, 0x40002) == 0x80002);
+	// an aligned range update merges them back into a single leaf
+	page_table_update_range(pt, 0x40000, 0x40000, 0x100000);
+	assert((tmp[1] & 3) == 3);
+	assert(page_table_query(pt, 0x5abcd) == 0x11abcd);
+	assert(page_table_query(pt, 0x40001) == 0x100001);
+	page_table_update_range(pt, 0x40000, 0x40000, NO_MAPPING);
+	assert(tmp[1] == 0);
+	assert(page_table_query(pt, 0x5abcd) == NO_MAPPING);
+	assert(page_table_query(pt, 0x803ff) == 0xc03ff);
+	printf("huge_page_test: PASSED\n");
+
+	// unmap_reclaims_tables_test
+	pt = alloc_page_frame();
+	page_table_update(pt, 0xcafecafeeee, 0xf00d);
+	page_table_update(pt, 0xcafecafeeef, 0xf00e);
+	tmp = phys_to_virt(pt << 12);
+	assert(tmp[levelIndex(0xcafecafeeee, 0)] & 1);
+	page_table_update(pt, 0xcafecafeeee, NO_MAPPING);
+	assert(tmp[levelIndex(0xcafecafeeee, 0)] & 1);
+	assert(page_table_query(pt, 0xcafecafeeef) == 0xf00e);
+	page_table_update(pt, 0xcafecafeeef, NO_MAPPING);
+	assert(tmp[levelIndex(0xcafecafeeee, 0)] == 0);
+	// unmapping something that was never mapped allocates nothing
+	page_table_update(pt, 0x1234, NO_MAPPING);
+	assert(tmp[levelIndex(0x1234, 0)] == 0);
+	// the freed frames are handed out again
+	new_pt = alloc_page_frame();
+	assert(new_pt != pt);
+	tmp = phys_to_virt(new_pt << 12);
+	for (int i = 0; i < 512; i++)
+		assert(tmp[i] == 0);
+	printf("unmap_reclaims_tables_test: PASSED\n");
+
+	// psc_test
+	{
+		uint64_t hits, misses;
+
+		pt = alloc_page_frame();
+		page_table_psc_enable(0x1e);
+		page_table_update(pt, 0x3c0000200, 0x1000);
+		page_table_update(pt, 0x3c0000300, 0x2000);
+		assert(page_table_query(pt, 0x3c0000200) == 0x1000);
+		// same 2 MiB region, resumes at the last level table
+		assert(page_table_query(pt, 0x3c0000300) == 0x2000);
+		assert(page_table_query(pt, 0x3c0000301) == NO_MAPPING);
+		page_table_psc_stats(4, &hits, &misses);
+		assert(hits == 2);
+		// same 1 GiB region, resumes one level up
+		assert(page_table_query(pt, 0x3c0012345) == NO_MAPPING);
+		page_table_psc_stats(3, &hits, &misses);
+		assert(hits == 1);
+		// the cached tables go away with the mappings
+		page_table_update(pt, 0x3c0000200, NO_MAPPING);
+		page_table_update(pt, 0x3c0000300, NO_MAPPING);
+		assert(page_table_query(pt, 0x3c0000300) == NO_MAPPING);
+		page_table_update(pt, 0x3c0000300, 0x3000);
+		assert(page_table_query(pt, 0x3c0000300) == 0x3000);
+		page_table_psc_enable(0);
+		printf("psc_test: PASSED\n");
+	}
+
+	// snapshot_test
+	{
+		const char *path = "os_test.snapshot";
+
+		pt = alloc_page_frame();
+		page_table_update_range(pt, 0x40000, 0x40000 + 0x10, 0x80000);
+		page_table_update(pt, 0xcafecafeeee, 0xf00d);
+		page_table_update(pt, 0x1ffff8000000, 0x1212);
+		assert(page_table_save(pt, path) == 0);
+		new_pt = page_table_load(path);
+		assert(new_pt != NO_MAPPING && new_pt != pt);
+		assert(page_table_query(new_pt, 0x3ffff) == NO_MAPPING);
+		assert(page_table_query(new_pt, 0x40000) == 0x80000);
+		assert(page_table_query(new_pt, 0x7ffff) == 0xbffff);
+		assert(page_table_query(new_pt, 0x8000f) == 0xc000f);
+		assert(page_table_query(new_pt, 0x80010) == NO_MAPPING);
+		assert(page_table_query(new_pt, 0xcafecafeeee) == 0xf00d);
+		assert(page_table_query(new_pt, 0x1ffff8000000) == 0x1212);
+		// the 1 GiB run comes back as a huge leaf
+		tmp = phys_to_virt(new_pt << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		tmp = phys_to_virt((tmp[0] >> 12) << 12);
+		assert((tmp[1] & 3) == 3);
+		// not a snapshot
+		FILE *f = fopen(path, "wb");
+		fputs("garbage", f);
+		fclose(f);
+		assert(page_table_load(path) == NO_MAPPING);
+		remove(path);
+		assert(page_table_load(path) == NO_MAPPING);
+		printf("snapshot_test: PASSED\n");
+	}
+
+	// for_each_test
+	{
+		struct scan scan = { .n = 0 };
+
+		pt = alloc_page_frame();
+		page_table_update(pt, 0x1ffff8000000, 0x1212);
+		page_table_update(pt, 0x5, 0x50);
+		page_table_update_range(pt, 0x200, 0x200, 0x400);
+		page_table_update(pt, 0x3, 0x30);
+		assert(page_table_for_each(pt, 0, NO_MAPPING, record_run, &scan) == 0);
+		assert(scan.n == 4);
+		assert(scan.runs[0][0] == 0x3 && scan.runs[0][1] == 0x30 && scan.runs[0][2] == 1);
+		assert(scan.runs[1][0] == 0x5 && scan.runs[1][1] == 0x50 && scan.runs[1][2] == 1);
+		assert(scan.runs[2][0] == 0x200 && scan.runs[2][1] == 0x400 && scan.runs[2][2] == 0x200);
+		assert(scan.runs[3][0] == 0x1ffff8000000 && scan.runs[3][1] == 0x1212);
+		// a range that cuts into the 2 MiB leaf
+		scan.n = 0;
+		assert(page_table_for_each(pt, 0x4, 0x210, record_run, &scan) == 0);
+		assert(scan.n == 2);
+		assert(scan.runs[1][0] == 0x200 && scan.runs[1][1] == 0x400 && scan.runs[1][2] == 0x10);
+		scan.n = 0;
+		assert(page_table_for_each(pt, 0x280, 0x1ffff8000000, record_run, &scan) == 0);
+		assert(scan.n == 1 && scan.runs[0][0] == 0x280 && scan.runs[0][1] == 0x480 && scan.runs[0][2] == 0x180);
+		scan.n = 0;
+		assert(page_table_for_each(pt, 0x6, 0x200, record_run, &scan) == 0 && scan.n == 0);
+		// stops when the callback says so
+		scan.n = 0;
+		scan.stop_at = 2;
+		assert(page_table_for_each(pt, 0, NO_MAPPING, record_run, &scan) == 42 && scan.n == 2);
+		printf("for_each_test: PASSED\n");
+	}
+
+	// for_each_nested_test: the callback queries and updates the page table
+	{
+		struct unmap unmap = { .n = 0 };
+
+		pt = alloc_page_frame();
+		page_table_update(pt, 0x3, 0x30);
+		page_table_update(pt, 0x5, 0x50);
+		page_table_update(pt, 0x1ffff8000000, 0x1212);
+		unmap.pt = pt;
+		unmap.free_frames = free_frames;
+		assert(page_table_for_each(pt, 0, NO_MAPPING, unmap_run, &unmap) == 0);
+		assert(unmap.n == 3);
+		assert(free_frames != unmap.free_frames);
+		assert(page_table_query(pt, 0x5) == NO_MAPPING);
+		assert(page_table_query(pt, 0x1ffff8000000) == NO_MAPPING);
+		printf("for_each_nested_test: PASSED\n");
+	}
+
+	// simd_kernels_test
+	for (int level = 0; level <= 2; level++) {
+		uint64_t rss = 0;
+
+		page_table_simd(level);
+		pt = alloc_page_frame();
+		// whole last level tables that can't be huge leaves
+		page_table_update_range(pt, 0x200, 0x600, 0x1001);
+		assert(page_table_query(pt, 0x1ff) == NO_MAPPING);
+		assert(page_table_query(pt, 0x200) == 0x1001);
+		assert(page_table_query(pt, 0x5ff) == 0x1400);
+		assert(page_table_query(pt, 0x7ff) == 0x1600);
+		assert(page_table_query(pt, 0x800) == NO_MAPPING);
+		page_table_for_each(pt, 0, NO_MAPPING, count_pages, &rss);
+		assert(rss == 0x600);
+		// splitting a 2 MiB leaf fills the new table
+		page_table_update_range(pt, 0x40000, 0x200, 0x80000);
+		page_table_update(pt, 0x40123, 0x5);
+		assert(page_table_query(pt, 0x40122) == 0x80122);
+		assert(page_table_query(pt, 0x40123) == 0x5);
+		assert(page_table_query(pt, 0x401ff) == 0x801ff);
+		page_table_update_range(pt, 0x300, 0x100, NO_MAPPING);
+		assert(page_table_query(pt, 0x2ff) == 0x1100);
+		assert(page_table_query(pt, 0x300) == NO_MAPPING);
+		assert(page_table_query(pt, 0x400) == 0x1201);
+		rss = 0;
+		page_table_for_each(pt, 0, NO_MAPPING, count_pages, &rss);
+		assert(rss == 0x500 + 0x200);
+		page_table_update_range(pt, 0, 0x80000, NO_MAPPING);
+		assert(((uint64_t *)phys_to_virt(pt << 12))[0] == 0);
+	}
+	page_table_simd(-1);
+	printf("simd_kernels_test: PASSED\n");
+
+	// clone_test
+	{
+		uint64_t child, grandchild, *root, *child_root;
+
+		pt = alloc_page_frame();
+		page_table_update(pt, 0xcafecafeeee, 0xf00d);
+		page_table_update(pt, 0xcafecafeeef, 0xf00e);
+		page_table_update(pt, 0xcafecafeeee + (1ULL << 27), 0xf00f);
+		page_table_update_range(pt, 0x40000, 0x200, 0x80000);
+		child = page_table_clone(pt);
+		root = phys_to_virt(pt << 12);
+		child_root = phys_to_virt(child << 12);
+		// the tables below the roots are shared and marked so
+		assert(root[levelIndex(0xcafecafeeee, 0)] == child_root[levelIndex(0xcafecafeeee, 0)]);
+		assert(root[levelIndex(0xcafecafeeee, 0)] & (1ULL << 62));
+		assert(page_table_query(child, 0xcafecafeeee) == 0xf00d);
+		assert(page_table_query(child, 0x40123) == 0x80123);
+		// unmapping what was never mapped copies no table
+		page_table_update(child, 0xcafecafeef0, NO_MAPPING);
+		assert(root[levelIndex(0xcafecafeeee, 0)] == child_root[levelIndex(0xcafecafeeee, 0)]);
+		assert(page_table_query(child, 0xcafecafeeee) == 0xf00d);
+		// updates on either side stay on that side
+		page_table_update(child, 0xcafecafeeee, 0xbeef);
+		assert(page_table_query(child, 0xcafecafeeee) == 0xbeef);
+		assert(page_table_query(pt, 0xcafecafeeee) == 0xf00d);
+		assert(root[levelIndex(0xcafecafeeee, 0)] != child_root[levelIndex(0xcafecafeeee, 0)]);
+		page_table_update(pt, 0xcafecafeeef, NO_MAPPING);
+		assert(page_table_query(pt, 0xcafecafeeef) == NO_MAPPING);
+		assert(page_table_query(child, 0xcafecafeeef) == 0xf00e);
+		// the tables the copies of both sides still share must survive the original
+		page_table_update_range(pt, 0x7770000000, 0x400, 0x1);
+		assert(page_table_query(pt, 0xcafecafeeee + (1ULL << 27)) == 0xf00f);
+		assert(page_table_query(child, 0xcafecafeeee + (1ULL << 27)) == 0xf00f);
+		page_table_update_range(pt, 0x7770000000, 0x400, NO_MAPPING);
+		page_table_update(pt, 0x40123, 0x1);
+		assert(page_table_query(pt, 0x40123) == 0x1);
+		assert(page_table_query(child, 0x40123) == 0x80123);
+		// a clone of a clone, then the middle generation goes away
+		grandchild = page_table_clone(child);
+		page_table_destroy(child);
+		assert(page_table_query(grandchild, 0xcafecafeeee) == 0xbeef);
+		assert(page_table_query(grandchild, 0xcafecafeeef) == 0xf00e);
+		assert(page_table_query(grandchild, 0x40124) == 0x80124);
+		page_table_update_range(grandchild, 0x40000, 0x200, NO_MAPPING);
+		assert(page_table_query(grandchild, 0x40124) == NO_MAPPING);
+		assert(page_table_query(pt, 0x40124) == 0x80124);
+		page_table_destroy(grandchild);
+		assert(page_table_query(pt, 0xcafecafeeee) == 0xf00d);
+		page_table_destroy(pt);
+		printf("clone_test: PASSED\n");
+	}
+
+	// many_threads_test
+	{
+		thrd_t threads[MANY_THREADS];
+		uint64_t rss = 0;
+
+		many_pt = alloc_page_frame();
+		for (uintptr_t i = 0; i < MANY_THREADS; i++)
+			assert(thrd_create(&threads[i], many_thread, (void *)i) == thrd_success);
+		for (int i = 0; i < MANY_THREADS; i++)
+			thrd_join(threads[i], NULL);
+		page_table_for_each(many_pt, 0, NO_MAPPING, count_pages, &rss);
+		assert(rss == 0);
+		assert(((uint64_t *)phys_to_virt(many_pt << 12))[0] == 0);
+		page_table_destroy(many_pt);
+		printf("many_threads_test: PASSED\n");
+	}
+
 	printf("All tests passed successfully!\n");
 
 	return 0;
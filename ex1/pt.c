@@ -1,44 +1,1583 @@
+
+#define _GNU_SOURCE
+
 #include "os.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <threads.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
 
+// PTEs are read and written atomically so that several threads can update and query
+// one page table at once. Lookups never lock; updates install missing tables with a
+// compare-and-swap, and tables that drop out of the trie are only handed back to
+// free_page_frame() once no thread can still be walking them.
+typedef _Atomic uint64_t pte_t;
 
-// Function to update the page table
-void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
-    uint64_t index;
-    uint64_t pt_addr = pt << 12;
-    uint64_t *pt_pointer;
+// ================================== software TLB ==================================
+// A small set-associative cache of (pt, vpn) -> ppn translations that sits in front
+// of the page walk. It is off by default: callers that edit PTEs behind our back (as
+// os_test.c does) would otherwise see stale translations. Every thread has its own
+// TLB. Once more than one thread has one, changing or removing a mapping bumps a
+// shared generation that makes the others flush theirs before their next lookup.
+#define TLB_SETS 64
+#define TLB_WAYS 4
+
+typedef struct TlbEntry {
+    uint64_t pt;
+    uint64_t vpn;
+    uint64_t ppn;
+    int valid;
+} TlbEntry;
+
+static _Thread_local TlbEntry tlb[TLB_SETS][TLB_WAYS];
+static _Thread_local unsigned tlb_victim[TLB_SETS];
+static _Thread_local uint64_t tlb_hits;
+static _Thread_local uint64_t tlb_misses;
+static _Thread_local uint64_t tlb_generation_seen;
+static _Thread_local int tlb_registered;
+static atomic_int tlb_enabled;
+static _Atomic uint64_t tlb_generation;
+static atomic_int tlb_threads;
+
+// a helper function to tell if the TLB is on
+static int tlbEnabled(void){
+    return atomic_load_explicit(&tlb_enabled, memory_order_relaxed);
+}
+
+// a helper function to pick the set of a translation
+static TlbEntry* tlbSet(uint64_t pt, uint64_t vpn){
+    return tlb[(vpn ^ pt) & (TLB_SETS - 1)];
+}
+
+// a helper function to drop every translation of the calling thread
+static void tlbLocalFlush(void){
+    int set, way;
+    for(set = 0; set < TLB_SETS; set++){
+        for(way = 0; way < TLB_WAYS; way++){
+            tlb[set][way].valid = 0;
+        }
+    }
+}
+
+// a helper function to look a translation up, returns 1 on a hit. generation receives
+// the generation the lookup ran under, to be handed on to tlbInsert().
+static int tlbLookup(uint64_t pt, uint64_t vpn, uint64_t* ppn, uint64_t* generation){
+    TlbEntry* set = tlbSet(pt, vpn);
+    int way;
+    if(!tlb_registered){
+        // before the generation is read: an update that misses this thread in
+        // tlb_threads must be seen by the walk that follows
+        tlb_registered = 1;
+        atomic_fetch_add(&tlb_threads, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    *generation = atomic_load_explicit(&tlb_generation, memory_order_acquire);
+    if(*generation != tlb_generation_seen){
+        tlbLocalFlush();
+        tlb_generation_seen = *generation;
+    }
+    for(way = 0; way < TLB_WAYS; way++){
+        if(set[way].valid && set[way].vpn == vpn && set[way].pt == pt){
+            *ppn = set[way].ppn;
+            tlb_hits++;
+            return 1;
+        }
+    }
+    tlb_misses++;
+    return 0;
+}
+
+// a helper function to cache a translation, evicting round robin within the set. The
+// translation is dropped if a mapping changed since the lookup that missed.
+static void tlbInsert(uint64_t pt, uint64_t vpn, uint64_t ppn, uint64_t generation){
+    unsigned set_index = (vpn ^ pt) & (TLB_SETS - 1);
+    TlbEntry* entry = &tlb[set_index][tlb_victim[set_index]];
+    if(atomic_load_explicit(&tlb_generation, memory_order_acquire) != generation){
+        return;
+    }
+    tlb_victim[set_index] = (tlb_victim[set_index] + 1) % TLB_WAYS;
+    entry->pt = pt;
+    entry->vpn = vpn;
+    entry->ppn = ppn;
+    entry->valid = 1;
+}
+
+void page_table_tlb_invalidate(uint64_t pt, uint64_t vpn){
+    TlbEntry* set = tlbSet(pt, vpn);
+    int way;
+    for(way = 0; way < TLB_WAYS; way++){
+        if(set[way].valid && set[way].vpn == vpn && set[way].pt == pt){
+            set[way].valid = 0;
+        }
+    }
+    // some other thread may hold the translation too, or be walking to it; pairs
+    // with the fence of a thread registering in tlbLookup()
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&tlb_threads, memory_order_relaxed) > tlb_registered){
+        atomic_fetch_add_explicit(&tlb_generation, 1, memory_order_release);
+    }
+}
+
+void page_table_tlb_flush(void){
+    tlbLocalFlush();
+    atomic_fetch_add_explicit(&tlb_generation, 1, memory_order_release);
+}
+
+void page_table_tlb_enable(int enable){
+    // entries may have gone stale while the TLB was off
+    page_table_tlb_flush();
+    atomic_store(&tlb_enabled, enable);
+}
+
+void page_table_tlb_stats(uint64_t* hits, uint64_t* misses){
+    *hits = tlb_hits;
+    *misses = tlb_misses;
+}
+
+// ================================== frame reclamation ==================================
+// Epoch based reclamation: a thread announces the global epoch while it walks tables,
+// and a table unlinked during epoch e is only freed once the epoch reached e + 2. The
+// epoch only advances once every thread inside a walk has announced the current one,
+// so by then nobody can still hold a pointer into the freed table.
+// Threads past the first EPOCH_SLOTS live ones share one more slot, which announces
+// the epoch of the first of them to enter until the last of them exits.
+#define EPOCH_SLOTS 256
+
+typedef struct EpochSlot {
+    _Alignas(64) _Atomic uint64_t epoch;    // (epoch << 1) | 1 while walking, 0 otherwise
+    atomic_int used;                        // the threads walking, in the shared slot
+} EpochSlot;
+
+// a table waiting for the epoch to advance, freed together with its subtree
+typedef struct Retired {
+    uint64_t ppn;
     int level;
-    for(level = 0; level <= 4; level++){
-        pt_pointer =  (uint64_t *)phys_to_virt(pt_addr);
-        index = (vpn >> ((4 - level) * 9)) & 0x1FF;
-     
-        if(!(pt_pointer[index] & 1)){
-            uint64_t new_pt = alloc_page_frame();
-            pt_pointer[index] = (new_pt << 12) + 1;
+    uint64_t epoch;
+    struct Retired* next;
+} Retired;
+
+static EpochSlot epoch_slots[EPOCH_SLOTS + 1];  // the last one is shared
+static atomic_flag epoch_shared_lock = ATOMIC_FLAG_INIT;
+static atomic_int epoch_slots_used;     // no slot at or above this index was ever claimed
+static _Atomic uint64_t global_epoch = 1;
+static _Thread_local EpochSlot* epoch_slot;
+static _Thread_local int epoch_depth;  // enters not yet matched by an exit
+static tss_t epoch_key;
+static once_flag epoch_once = ONCE_FLAG_INIT;
+static Retired* retired;
+static uint64_t retired_scanned;        // the epoch the retired list was last scanned at
+static atomic_int retired_pending;
+static atomic_flag retired_lock = ATOMIC_FLAG_INIT;
+// bumped every time a table drops out of a trie, see the paging-structure cache
+static _Atomic uint64_t psc_generation;
+
+static void freeTable(uint64_t ppn, int level);
+
+// a helper function to give a thread's slot back when the thread exits
+static void epochSlotRelease(void* slot){
+    atomic_store(&((EpochSlot*)slot)->used, 0);
+}
+
+static void epochKeyInit(void){
+    tss_create(&epoch_key, epochSlotRelease);
+}
+
+// a helper function to claim a slot for the calling thread, the shared one if every
+// other slot is taken
+static void epochRegister(void){
+    int expected;
+    int used;
+    int i;
+    call_once(&epoch_once, epochKeyInit);
+    for(i = 0; i < EPOCH_SLOTS; i++){
+        expected = 0;
+        if(atomic_compare_exchange_strong(&epoch_slots[i].used, &expected, 1)){
+            break;
         }
-        pt_addr = pt_pointer[index] - 1;
     }
-    if (ppn == NO_MAPPING){
-        pt_pointer[index] = 0;
+    used = atomic_load(&epoch_slots_used);
+    while(used <= i && !atomic_compare_exchange_weak(&epoch_slots_used, &used, i + 1)){
+    }
+    epoch_slot = &epoch_slots[i];
+    if(i < EPOCH_SLOTS){
+        tss_set(epoch_key, epoch_slot);
+    }
+}
+
+// a helper function to lock the shared slot
+static void epochSharedLock(void){
+    while(atomic_flag_test_and_set_explicit(&epoch_shared_lock, memory_order_acquire)){
+        thrd_yield();
+    }
+}
+
+// a helper function to try to move the global epoch on by one
+static void epochAdvance(void){
+    uint64_t epoch = atomic_load(&global_epoch);
+    uint64_t announced;
+    int used = atomic_load(&epoch_slots_used);
+    int i;
+    for(i = 0; i < used; i++){
+        announced = atomic_load(&epoch_slots[i].epoch);
+        if((announced & 1) && (announced >> 1) != epoch){
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+// a helper function to free the retired tables that nobody can reach any more.
+// Returns whether it freed any.
+static int reclaim(void){
+    Retired* node;
+    Retired** link;
+    Retired* done = NULL;
+    uint64_t epoch;
+    if(atomic_flag_test_and_set_explicit(&retired_lock, memory_order_acquire)){
+        // someone else is on it
+        return 0;
+    }
+    epochAdvance();
+    epochAdvance();
+    epoch = atomic_load(&global_epoch);
+    if(epoch == retired_scanned){
+        // nothing became reclaimable since the last scan, don't walk the list again
+        atomic_flag_clear_explicit(&retired_lock, memory_order_release);
+        return 0;
+    }
+    retired_scanned = epoch;
+    link = &retired;
+    while(*link != NULL){
+        node = *link;
+        if(node->epoch + 2 <= epoch){
+            *link = node->next;
+            node->next = done;
+            done = node;
+            atomic_fetch_sub_explicit(&retired_pending, 1, memory_order_relaxed);
+        }
+        else{
+            link = &node->next;
+        }
+    }
+    atomic_flag_clear_explicit(&retired_lock, memory_order_release);
+    if(done == NULL){
+        return 0;
+    }
+    while(done != NULL){
+        node = done;
+        done = node->next;
+        freeTable(node->ppn, node->level);
+        free(node);
+    }
+    return 1;
+}
+
+// a helper function to hand a table that was just unlinked, with whatever is still
+// below it, over to reclamation
+static void retireTable(uint64_t ppn, int level){
+    Retired* node = malloc(sizeof(Retired));
+    if(node == NULL){
+        abort();
+    }
+    node->ppn = ppn;
+    node->level = level;
+    // before reading the epoch, so a walker that enters after the table could be
+    // freed is sure to see the new generation
+    atomic_fetch_add(&psc_generation, 1);
+    node->epoch = atomic_load(&global_epoch);
+    while(atomic_flag_test_and_set_explicit(&retired_lock, memory_order_acquire)){
+        thrd_yield();
+    }
+    node->next = retired;
+    retired = node;
+    atomic_fetch_add_explicit(&retired_pending, 1, memory_order_relaxed);
+    atomic_flag_clear_explicit(&retired_lock, memory_order_release);
+}
+
+// a helper function to announce that the calling thread starts walking tables. Nests,
+// so a page_table_for_each() callback can query and update: only the outermost call
+// announces the epoch.
+static void epochEnter(void){
+    if(epoch_depth++ > 0){
+        return;
+    }
+    if(epoch_slot == NULL){
+        epochRegister();
+    }
+    if(epoch_slot == &epoch_slots[EPOCH_SLOTS]){
+        // the first thread in announces the epoch for the others, which is no newer
+        // than the one they would announce
+        epochSharedLock();
+        if(atomic_fetch_add(&epoch_slot->used, 1) == 0){
+            atomic_store_explicit(&epoch_slot->epoch, (atomic_load(&global_epoch) << 1) | 1,
+                                  memory_order_relaxed);
+        }
+        atomic_flag_clear_explicit(&epoch_shared_lock, memory_order_release);
+    }
+    else{
+        atomic_store_explicit(&epoch_slot->epoch, (atomic_load(&global_epoch) << 1) | 1,
+                              memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+// a helper function to announce that the calling thread is done walking tables
+static void epochExit(void){
+    if(--epoch_depth > 0){
+        return;
+    }
+    if(epoch_slot == &epoch_slots[EPOCH_SLOTS]){
+        epochSharedLock();
+        if(atomic_fetch_sub(&epoch_slot->used, 1) == 1){
+            atomic_store_explicit(&epoch_slot->epoch, 0, memory_order_release);
+        }
+        atomic_flag_clear_explicit(&epoch_shared_lock, memory_order_release);
+    }
+    else{
+        atomic_store_explicit(&epoch_slot->epoch, 0, memory_order_release);
+    }
+    // freeing a table can retire shared tables below it, which can go as well unless
+    // other threads hold the epoch back
+    while(atomic_load_explicit(&retired_pending, memory_order_relaxed) > 0 && reclaim()){
+    }
+}
+
+// ================================== shared tables ==================================
+// page_table_clone() lets page tables share tables. A shared table is never written
+// again; the number of PTEs pointing to it lives here, keyed by its frame, from its
+// first clone until the last of them goes away. A table that is not in here has only
+// ever had a single PTE pointing to it. Sharing changes on clones and on copy-on-write
+// breaks only, so one lock is enough.
+typedef struct ShareEntry {
+    uint64_t ppn;       // NO_MAPPING when the slot is empty
+    uint64_t refs;
+} ShareEntry;
+
+static ShareEntry* shares;
+static uint64_t shares_size;
+static uint64_t shares_used;
+static mtx_t shares_lock;
+static once_flag shares_once = ONCE_FLAG_INIT;
+
+static void sharesInit(void){
+    mtx_init(&shares_lock, mtx_plain);
+}
+
+// a helper function to find the slot of ppn, or the empty slot it would go in
+static ShareEntry* shareSlot(uint64_t ppn){
+    uint64_t i = (ppn * 0x9E3779B97F4A7C15ULL) >> 32;
+    for(;; i++){
+        ShareEntry* entry = &shares[i & (shares_size - 1)];
+        if(entry->ppn == ppn || entry->ppn == NO_MAPPING){
+            return entry;
+        }
+    }
+}
+
+// a helper function to double the table once it is half full
+static void sharesGrow(void){
+    ShareEntry* old = shares;
+    uint64_t old_size = shares_size;
+    uint64_t i;
+    shares_size = old_size ? old_size * 2 : 64;
+    shares = malloc(shares_size * sizeof(ShareEntry));
+    if(shares == NULL){
+        abort();
+    }
+    for(i = 0; i < shares_size; i++){
+        shares[i].ppn = NO_MAPPING;
+    }
+    for(i = 0; i < old_size; i++){
+        if(old[i].ppn != NO_MAPPING){
+            *shareSlot(old[i].ppn) = old[i];
+        }
+    }
+    free(old);
+}
+
+// a helper function to count one more PTE pointing to the table ppn
+static void shareInc(uint64_t ppn){
+    ShareEntry* entry;
+    call_once(&shares_once, sharesInit);
+    mtx_lock(&shares_lock);
+    if(2 * (shares_used + 1) > shares_size){
+        sharesGrow();
+    }
+    entry = shareSlot(ppn);
+    if(entry->ppn == NO_MAPPING){
+        entry->ppn = ppn;
+        entry->refs = 1;
+        shares_used++;
+    }
+    entry->refs++;
+    mtx_unlock(&shares_lock);
+}
+
+// a helper function to count one PTE less pointing to the table ppn. Returns how many
+// are left, 0 meaning the table is not used any more, or -1 if it was never shared.
+static int64_t shareDec(uint64_t ppn){
+    ShareEntry* entry;
+    ShareEntry* hole;
+    int64_t refs = -1;
+    uint64_t i, home;
+    call_once(&shares_once, sharesInit);
+    mtx_lock(&shares_lock);
+    if(shares_size > 0 && (entry = shareSlot(ppn))->ppn == ppn){
+        refs = --entry->refs;
+        if(refs == 0){
+            // close the gap so the probe chains stay intact
+            entry->ppn = NO_MAPPING;
+            shares_used--;
+            hole = entry;
+            for(i = (entry - shares + 1) & (shares_size - 1); shares[i].ppn != NO_MAPPING; i = (i + 1) & (shares_size - 1)){
+                home = ((shares[i].ppn * 0x9E3779B97F4A7C15ULL) >> 32) & (shares_size - 1);
+                // move the entry back unless its home lies cyclically in (hole, i]
+                if(((i - home) & (shares_size - 1)) >= (uint64_t)((i - (hole - shares)) & (shares_size - 1))){
+                    *hole = shares[i];
+                    shares[i].ppn = NO_MAPPING;
+                    hole = &shares[i];
+                }
+            }
+        }
+    }
+    mtx_unlock(&shares_lock);
+    return refs;
+}
+
+// ================================== page walk ==================================
+// A PTE holds the frame number in bits 12 and up. Bit 0 marks it valid and bit 1 marks
+// a huge leaf: an entry of one of the two levels above the last (a level 2 or 3 table
+// of the default shape) that maps a whole 1 GiB or 2 MiB run of pages starting at its
+// frame instead of pointing to the next table.
+// A PTE that points to a table keeps the number of valid entries of that table in
+// bits 2-11, so an emptied table can be handed back to free_page_frame(). Updates
+// reserve their entry in that count before they make it valid, so the compare-and-
+// swap that drops a count to zero (and unlinks the table) can only succeed once
+// nothing is mapped in the table and nobody is about to map anything there.
+// Bit 62 of a PTE that points to a table marks the table as possibly shared with
+// another page table. Updates never write below such a PTE: they first point it to
+// a private copy of the table, whose own table PTEs are then marked shared in turn.
+// The shape of the trie comes from PT_LEVELS and PT_BITS in os.h, so every loop over
+// the levels has a constant trip count. A table fills one 4 KiB frame whatever the
+// radix; with fewer than 9 bits per level only its first entries are used.
+#define LEVELS PT_LEVELS
+#define BITS PT_BITS
+#define ENTRIES (1 << BITS)                 // entries used per table
+#define MASK_WORDS ((ENTRIES + 63) / 64)    // words of a tableMask() mask
+#define VPN_LIMIT (1ULL << (LEVELS * BITS)) // VPNs are below this
+#define PTE_VALID 0x1ULL
+#define PTE_HUGE 0x2ULL
+#define PTE_COUNT_SHIFT 2
+#define PTE_COUNT (0x3FFULL << PTE_COUNT_SHIFT)
+#define PTE_COUNT_MAX 0x3FFULL
+#define PTE_COW (1ULL << 62)
+#define PTE_ADDR 0x000FFFFFFFFFF000ULL
+#define HUGE_MIN_LEVEL (LEVELS > 3 ? LEVELS - 3 : 1)  // huge leaves in the two levels above the last
+
+_Static_assert(BITS >= 2 && BITS <= 9, "a table must hold 4 to 512 PTEs to fit one frame");
+_Static_assert(LEVELS >= 2 && LEVELS * BITS <= 64 - 12, "a VPN must fit a virtual address");
+
+// walkTo() flags
+#define WALK_ALLOCATE 0x1   // allocate missing tables
+#define WALK_SPLIT 0x2      // split huge leaves on the way down
+#define WALK_UNSHARE 0x4    // copy shared tables on the way down
+
+static void tableMask(pte_t* table, uint64_t mask[MASK_WORDS]);
+static void tableFill(pte_t* table, uint64_t first, uint64_t step);
+
+// A walk cursor remembers the table it reached at every level for the last VPN, so
+// walking to a neighboring VPN only re-walks the levels below the first index that
+// changed. page_table_update() and page_table_query() use a fresh cursor per call,
+// the range and batch entry points keep one across VPNs.
+typedef struct Walk {
+    uint64_t pt;
+    uint64_t vpn;
+    uint64_t value;     // the PTE the last walkTo() stopped at, as it was read
+    int depth;          // tables[0 .. depth-1] are valid for vpn
+    pte_t* tables[LEVELS];
+    uint64_t ppns[LEVELS];
+} Walk;
+
+// a helper function to get the index of vpn in a table at the given level
+static uint64_t levelIndex(uint64_t vpn, int level){
+    return (vpn >> ((LEVELS - 1 - level) * BITS)) & (ENTRIES - 1);
+}
+
+// a helper function to get the number of pages mapped by one entry at the given level
+static uint64_t levelSpan(int level){
+    return 1ULL << ((LEVELS - 1 - level) * BITS);
+}
+
+// a helper function to get the table a valid non-huge PTE points to
+static pte_t* pteTable(uint64_t pte){
+    return (pte_t *)phys_to_virt(pte & PTE_ADDR);
+}
+
+// a helper function to get the frame of the table a valid non-huge PTE points to
+static uint64_t pteFrame(uint64_t pte){
+    return (pte & PTE_ADDR) >> 12;
+}
+
+// a helper function to tell whether a valid PTE at the given level points to a table
+static int pteIsTable(uint64_t pte, int level){
+    return level < LEVELS - 1 && !(pte & PTE_HUGE);
+}
+
+// a helper function to get the number of valid entries a table PTE records
+static uint64_t pteCount(uint64_t pte){
+    return (pte & PTE_COUNT) >> PTE_COUNT_SHIFT;
+}
+
+// a helper function to free the table ppn at the given level and every table below it
+static void freeTable(uint64_t ppn, int level){
+    pte_t* table = (pte_t *)phys_to_virt(ppn << 12);
+    uint64_t mask[MASK_WORDS];
+    uint64_t bits;
+    uint64_t pte;
+    int64_t refs;
+    int word;
+    if(level < LEVELS - 1){
+        tableMask(table, mask);
+        for(word = 0; word < MASK_WORDS; word++){
+            for(bits = mask[word]; bits != 0; bits &= bits - 1){
+                pte = atomic_load_explicit(&table[word * 64 + __builtin_ctzll(bits)], memory_order_relaxed);
+                if(!pteIsTable(pte, level)){
+                    continue;
+                }
+                // a shared table lives on in the page tables still using it, and one
+                // they dropped may have been walked into through them since this
+                // table was retired, so it waits for walkers of its own to finish
+                refs = shareDec(pteFrame(pte));
+                if(refs < 0){
+                    freeTable(pteFrame(pte), level + 1);
+                }
+                else if(refs == 0){
+                    retireTable(pteFrame(pte), level + 1);
+                }
+            }
+        }
+    }
+    free_page_frame(ppn);
+}
+
+// a helper function to start a walk at the root of pt
+static void walkInit(Walk* walk, uint64_t pt){
+    walk->pt = pt;
+    walk->vpn = 0;
+    walk->depth = 1;
+    walk->tables[0] = (pte_t *)phys_to_virt(pt << 12);
+    walk->ppns[0] = pt;
+}
+
+// a helper function to get the PTE that points to the walk's table at the given level
+static pte_t* walkParent(Walk* walk, int level){
+    return &walk->tables[level - 1][levelIndex(walk->vpn, level - 1)];
+}
+
+// a helper function to tell whether a parent PTE still points to the walk's table
+static int walkLinked(Walk* walk, int level, uint64_t parent){
+    return (parent & PTE_VALID) && !(parent & PTE_HUGE) && pteFrame(parent) == walk->ppns[level];
+}
+
+// a helper function to reserve count more valid entries in the walk's table at the
+// given level. Returns 0 (and resets the cursor) when the table has been unlinked.
+static int reserveEntries(Walk* walk, int level, uint64_t count){
+    pte_t* parent;
+    uint64_t value;
+    if(level == 0 || count == 0){
+        return 1;
+    }
+    parent = walkParent(walk, level);
+    value = atomic_load_explicit(parent, memory_order_acquire);
+    for(;;){
+        if(!walkLinked(walk, level, value)){
+            walk->depth = 1;
+            return 0;
+        }
+        if(pteCount(value) + count > PTE_COUNT_MAX){
+            // too many racing reservations, let them settle
+            thrd_yield();
+            value = atomic_load_explicit(parent, memory_order_acquire);
+            continue;
+        }
+        if(atomic_compare_exchange_weak_explicit(parent, &value, value + (count << PTE_COUNT_SHIFT),
+                                                 memory_order_acq_rel, memory_order_acquire)){
+            return 1;
+        }
+    }
+}
+
+// a helper function to give back count valid entries (or reservations) of the walk's
+// table at the given level. The update that drops the count to zero unlinks the table
+// and retires it, which may in turn empty its parent.
+static void releaseEntries(Walk* walk, int level, uint64_t count){
+    pte_t* parent;
+    uint64_t value;
+    uint64_t left;
+    uint64_t desired;
+    while(level > 0 && count > 0){
+        parent = walkParent(walk, level);
+        value = atomic_load_explicit(parent, memory_order_acquire);
+        do{
+            if(!walkLinked(walk, level, value)){
+                // cut off by a huge leaf, the table is retired with its subtree
+                return;
+            }
+            left = pteCount(value) - count;
+            desired = left > 0 ? (value & ~PTE_COUNT) | (left << PTE_COUNT_SHIFT) : 0;
+        } while(!atomic_compare_exchange_weak_explicit(parent, &value, desired,
+                                                       memory_order_acq_rel, memory_order_acquire));
+        if(left > 0){
+            return;
+        }
+        retireTable(walk->ppns[level], level);
+        if(walk->depth > level){
+            walk->depth = level;
+        }
+        level--;
+        count = 1;
+    }
+}
+
+// a helper function to drop the reference the table PTE pte of a table at the given
+// level holds, retiring the table below it unless another page table still shares it
+static void releaseTable(uint64_t pte, int level){
+    if((pte & PTE_COW) && shareDec(pteFrame(pte)) > 0){
         return;
     }
-    pt_pointer[index] = (ppn << 12) + 1;
+    retireTable(pteFrame(pte), level + 1);
+}
+
+// a helper function to atomically replace the PTE pte of the walk's table at the
+// given level by value, keeping the table's valid entry count up to date and retiring
+// any tables the old value pointed to. old receives the replaced PTE. Returns 0 when
+// the table was unlinked before the new entry could be counted.
+static int setPte(Walk* walk, int level, pte_t* pte, uint64_t value, uint64_t* old){
+    int reserved = 0;
+    *old = atomic_load_explicit(pte, memory_order_acquire);
+    do{
+        if(!(*old & PTE_VALID) && (value & PTE_VALID) && !reserved){
+            if(!reserveEntries(walk, level, 1)){
+                return 0;
+            }
+            reserved = 1;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(pte, old, value, memory_order_acq_rel, memory_order_acquire));
+    if(*old & PTE_VALID){
+        if(pteIsTable(*old, level)){
+            releaseTable(*old, level);
+            if(walk->depth > level + 1){
+                walk->depth = level + 1;
+            }
+        }
+        // either the entry goes away or somebody else made it valid before us
+        if(reserved || !(value & PTE_VALID)){
+            releaseEntries(walk, level, 1);
+        }
+    }
+    return 1;
+}
+
+// a helper function to install a new table in the invalid PTE pte of the walk's table
+// at the given level. Returns the PTE that ends up there, which is another thread's
+// entry if it got there first, or 0 when the walk has to start over.
+static uint64_t installTable(Walk* walk, int level, pte_t* pte, uint64_t old){
+    uint64_t new_pt;
+    uint64_t value;
+    if(!reserveEntries(walk, level, 1)){
+        return 0;
+    }
+    new_pt = alloc_page_frame();
+    value = (new_pt << 12) | PTE_VALID;
+    while(!(old & PTE_VALID)){
+        if(atomic_compare_exchange_weak_explicit(pte, &old, value, memory_order_acq_rel, memory_order_acquire)){
+            return value;
+        }
+    }
+    // nobody else has seen our table, so it can go straight back
+    free_page_frame(new_pt);
+    releaseEntries(walk, level, 1);
+    return old;
+}
+
+// a helper function to replace the huge leaf old in pte of a table at the given level
+// by a full table one level down that maps the same pages with smaller leaves.
+// Returns the PTE that ends up there.
+static uint64_t splitHuge(pte_t* pte, int level, uint64_t old){
+    uint64_t new_pt = alloc_page_frame();
+    pte_t* table = (pte_t *)phys_to_virt(new_pt << 12);
+    uint64_t ppn = old >> 12;
+    uint64_t span = levelSpan(level + 1);
+    uint64_t flags = level + 1 < LEVELS - 1 ? PTE_HUGE | PTE_VALID : PTE_VALID;
+    uint64_t value = (new_pt << 12) | ((uint64_t)ENTRIES << PTE_COUNT_SHIFT) | PTE_VALID;
+    tableFill(table, (ppn << 12) | flags, span << 12);
+    if(atomic_compare_exchange_strong_explicit(pte, &old, value, memory_order_acq_rel, memory_order_acquire)){
+        return value;
+    }
+    free_page_frame(new_pt);
+    return old;
+}
+
+// a helper function to map the ENTRIES VPNs below the invalid PTE pte of the walk's table
+// at level LEVELS - 2 to consecutive PPNs from ppn, by filling a new last level table
+// before it is linked in. Returns 0 when the walk has to go on one entry at a time.
+static int installLeaves(Walk* walk, pte_t* pte, uint64_t old, uint64_t ppn){
+    uint64_t new_pt;
+    if(!reserveEntries(walk, LEVELS - 2, 1)){
+        return 0;
+    }
+    new_pt = alloc_page_frame();
+    tableFill((pte_t *)phys_to_virt(new_pt << 12), (ppn << 12) | PTE_VALID, 1ULL << 12);
+    if(atomic_compare_exchange_strong_explicit(pte, &old, (new_pt << 12) | ((uint64_t)ENTRIES << PTE_COUNT_SHIFT) | PTE_VALID,
+                                               memory_order_acq_rel, memory_order_acquire)){
+        return 1;
+    }
+    // somebody else installed a table meanwhile
+    free_page_frame(new_pt);
+    releaseEntries(walk, LEVELS - 2, 1);
+    return 0;
+}
+
+// a helper function to point the shared PTE old in pte of a table at the given level
+// to a private copy of the shared table. The tables the copy points to are shared
+// with the original from then on. Returns the PTE that ends up there.
+static uint64_t unshareTable(pte_t* pte, int level, uint64_t old){
+    pte_t* shared = pteTable(old);
+    uint64_t new_pt = alloc_page_frame();
+    pte_t* table = (pte_t *)phys_to_virt(new_pt << 12);
+    uint64_t value = (new_pt << 12) | (old & PTE_COUNT) | PTE_VALID;
+    uint64_t expected = old;
+    uint64_t mask[MASK_WORDS];
+    uint64_t bits;
+    uint64_t entry;
+    int word, index;
+    tableMask(shared, mask);
+    for(word = 0; word < MASK_WORDS; word++){
+        for(bits = mask[word]; bits != 0; bits &= bits - 1){
+            index = word * 64 + __builtin_ctzll(bits);
+            entry = atomic_load_explicit(&shared[index], memory_order_relaxed);
+            if(pteIsTable(entry, level + 1)){
+                entry |= PTE_COW;
+                shareInc(pteFrame(entry));
+            }
+            atomic_store_explicit(&table[index], entry, memory_order_relaxed);
+        }
+    }
+    if(atomic_compare_exchange_strong_explicit(pte, &expected, value, memory_order_acq_rel, memory_order_acquire)){
+        // cached walks of this page table must not resume in the shared table
+        atomic_fetch_add(&psc_generation, 1);
+        releaseTable(old, level);
+        return value;
+    }
+    // another update of this page table got there first, the original still holds
+    // every table our copy pointed to
+    for(index = 0; index < ENTRIES; index++){
+        entry = atomic_load_explicit(&table[index], memory_order_relaxed);
+        if((entry & PTE_VALID) && pteIsTable(entry, level + 1)){
+            shareDec(pteFrame(entry));
+        }
+    }
+    free_page_frame(new_pt);
+    return expected;
+}
+
+// a helper function to walk down towards the table at target_level that maps vpn,
+// reusing the tables of the previous VPN for every level whose index is unchanged.
+// Returns the PTE of vpn in the deepest table reached, leaves that table's level in
+// walk->depth - 1 and the PTE as read in walk->value. The walk stops early at an
+// invalid entry unless WALK_ALLOCATE is set and at a huge leaf unless WALK_SPLIT is
+// set, and only copies the shared tables it passes if WALK_UNSHARE is set. An
+// allocating walk returns NULL when a table was unlinked under it; the cursor is reset
+// and the walk has to be retried.
+static pte_t* walkTo(Walk* walk, uint64_t vpn, int target_level, int flags){
+    pte_t* pte;
+    uint64_t value;
+    int level = 1;
+    // keep the levels whose table is selected by the same vpn prefix
+    while(level < walk->depth && level <= target_level && ((vpn ^ walk->vpn) >> ((LEVELS - level) * BITS)) == 0){
+        level++;
+    }
+    walk->vpn = vpn;
+    walk->depth = level;
+    for(; level <= target_level; level++){
+        pte = &walk->tables[level - 1][levelIndex(vpn, level - 1)];
+        value = atomic_load_explicit(pte, memory_order_acquire);
+        for(;;){
+            if(!(value & PTE_VALID)){
+                if(!(flags & WALK_ALLOCATE)){
+                    walk->value = value;
+                    return pte;
+                }
+                value = installTable(walk, level - 1, pte, value);
+                if(value == 0){
+                    return NULL;
+                }
+            }
+            else if(value & PTE_HUGE){
+                if(!(flags & WALK_SPLIT)){
+                    walk->value = value;
+                    return pte;
+                }
+                value = splitHuge(pte, level - 1, value);
+            }
+            else if((value & PTE_COW) && (flags & WALK_UNSHARE)){
+                value = unshareTable(pte, level - 1, value);
+            }
+            else{
+                break;
+            }
+        }
+        walk->tables[level] = pteTable(value);
+        walk->ppns[level] = pteFrame(value);
+        walk->depth = level + 1;
+    }
+    pte = &walk->tables[target_level][levelIndex(vpn, target_level)];
+    walk->value = atomic_load_explicit(pte, memory_order_acquire);
+    return pte;
+}
+
+// a helper function to translate vpn through the PTE the last walk stopped at
+static uint64_t walkTranslate(Walk* walk, uint64_t vpn){
+    int level = walk->depth - 1;
+    if(!(walk->value & PTE_VALID)){
+        return NO_MAPPING;
+    }
+    if(level < LEVELS - 1){
+        // a huge leaf, the low VPN bits select the page inside it
+        return (walk->value >> 12) + (vpn & (levelSpan(level) - 1));
+    }
+    return walk->value >> 12;
+}
+
+// ================================== table kernels ==================================
+// Filling a table with evenly spaced PTEs and gathering its valid bits are the inner
+// loops of bulk maps, splits, scans and reclamation. On x86 they handle 4 PTEs at a
+// time with AVX2 or 2 with SSE2, picked once at run time, and fall back to plain
+// loops elsewhere. The vector kernels read tables without atomics: a torn view is
+// fine because every entry a mask reports is loaded again atomically before it is
+// used. They only fill tables that no other thread can see yet.
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+
+static atomic_int simd_level = -1;      // -1 until picked
+
+// a helper function to get the widest kernel the CPU supports
+static int simdBest(void){
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return SIMD_AVX2;
+    }
+    if(__builtin_cpu_supports("sse2")){
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+// a helper function to get the kernel to use
+static int simdLevel(void){
+    int level = atomic_load_explicit(&simd_level, memory_order_relaxed);
+    if(level < 0){
+        level = simdBest();
+        atomic_store_explicit(&simd_level, level, memory_order_relaxed);
+    }
+    return level;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("avx2")))
+static void tableMaskAvx2(const uint64_t* table, uint64_t mask[MASK_WORDS]){
+    __m256i v;
+    uint64_t bits;
+    int word, i;
+    for(word = 0; word < MASK_WORDS; word++){
+        bits = 0;
+        for(i = 0; i < 64 && word * 64 + i < ENTRIES; i += 4){
+            // move bit 0 of every PTE into its sign bit and collect the signs
+            v = _mm256_loadu_si256((const __m256i *)&table[word * 64 + i]);
+            v = _mm256_slli_epi64(v, 63);
+            bits |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(v)) << i;
+        }
+        mask[word] = bits;
+    }
+}
+
+__attribute__((target("avx2")))
+static void tableFillAvx2(uint64_t* table, uint64_t first, uint64_t step){
+    __m256i v = _mm256_set_epi64x(first + 3 * step, first + 2 * step, first + step, first);
+    __m256i increment = _mm256_set1_epi64x(4 * step);
+    int i;
+    for(i = 0; i < ENTRIES; i += 4){
+        _mm256_storeu_si256((__m256i *)&table[i], v);
+        v = _mm256_add_epi64(v, increment);
+    }
+}
+
+__attribute__((target("sse2")))
+static void tableMaskSse2(const uint64_t* table, uint64_t mask[MASK_WORDS]){
+    __m128i v;
+    uint64_t bits;
+    int word, i;
+    for(word = 0; word < MASK_WORDS; word++){
+        bits = 0;
+        for(i = 0; i < 64 && word * 64 + i < ENTRIES; i += 2){
+            v = _mm_loadu_si128((const __m128i *)&table[word * 64 + i]);
+            v = _mm_slli_epi64(v, 63);
+            bits |= (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(v)) << i;
+        }
+        mask[word] = bits;
+    }
+}
+
+__attribute__((target("sse2")))
+static void tableFillSse2(uint64_t* table, uint64_t first, uint64_t step){
+    __m128i v = _mm_set_epi64x(first + step, first);
+    __m128i increment = _mm_set1_epi64x(2 * step);
+    int i;
+    for(i = 0; i < ENTRIES; i += 2){
+        _mm_storeu_si128((__m128i *)&table[i], v);
+        v = _mm_add_epi64(v, increment);
+    }
+}
+#endif
+
+// a helper function to collect the valid bits of a table into a mask of ENTRIES bits
+static void tableMask(pte_t* table, uint64_t mask[MASK_WORDS]){
+    int word, bit;
+    switch(simdLevel()){
+#ifdef SIMD_X86
+    case SIMD_AVX2:
+        tableMaskAvx2((const uint64_t *)table, mask);
+        return;
+    case SIMD_SSE2:
+        tableMaskSse2((const uint64_t *)table, mask);
+        return;
+#endif
+    default:
+        break;
+    }
+    for(word = 0; word < MASK_WORDS; word++){
+        mask[word] = 0;
+        for(bit = 0; bit < 64 && word * 64 + bit < ENTRIES; bit++){
+            mask[word] |= (atomic_load_explicit(&table[word * 64 + bit], memory_order_relaxed) & PTE_VALID) << bit;
+        }
+    }
+}
+
+// a helper function to fill a table nobody else can reach with first, first + step,
+// first + 2 * step, ...
+static void tableFill(pte_t* table, uint64_t first, uint64_t step){
+    int i;
+    switch(simdLevel()){
+#ifdef SIMD_X86
+    case SIMD_AVX2:
+        tableFillAvx2((uint64_t *)table, first, step);
+        return;
+    case SIMD_SSE2:
+        tableFillSse2((uint64_t *)table, first, step);
+        return;
+#endif
+    default:
+        break;
+    }
+    for(i = 0; i < ENTRIES; i++){
+        atomic_store_explicit(&table[i], first + i * step, memory_order_relaxed);
+    }
+}
+
+// a helper function to count the bits of mask in [first, end)
+static uint64_t maskCount(const uint64_t mask[MASK_WORDS], uint64_t first, uint64_t end){
+    uint64_t count = 0;
+    uint64_t bits;
+    uint64_t word;
+    for(word = first / 64; word * 64 < end; word++){
+        bits = mask[word];
+        if(word == first / 64){
+            bits &= ~0ULL << (first % 64);
+        }
+        if(end < (word + 1) * 64){
+            bits &= (1ULL << (end % 64)) - 1;
+        }
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
+
+// Function to cap the table kernels at level (0 plain loops, 1 SSE2, 2 AVX2, or -1 for
+// the best the CPU supports). Returns the level in use.
+int page_table_simd(int level){
+    int best = simdBest();
+    if(level < 0 || level > best){
+        level = best;
+    }
+    atomic_store(&simd_level, level);
+    return level;
+}
+
+// ================================== paging-structure cache ==================================
+// A per-thread cache of the tables a query walked through, keyed by the VPN prefix
+// that selects each table, like the paging-structure caches of x86 MMUs. A query
+// that misses the TLB starts its walk at the deepest cached table instead of the
+// root, so the last level table of a recently touched region (2 MiB with the default
+// shape) is one hop away even if the VPNs in it are too sparse to stay in the TLB.
+// Every table that drops out of a trie bumps psc_generation, which makes each thread
+// drop its cached tables before its next lookup. Like the TLB it is off by default,
+// and only queries use it: updates need the whole path to keep the valid entry counts
+// straight.
+#define PSC_ENTRIES 32
+
+typedef struct PscEntry {
+    uint64_t pt;
+    uint64_t prefix;
+    pte_t* table;       // NULL when the entry is empty
+} PscEntry;
+
+static _Thread_local PscEntry psc[LEVELS][PSC_ENTRIES];
+static _Thread_local uint64_t psc_hits[LEVELS];
+static _Thread_local uint64_t psc_misses[LEVELS];
+static _Thread_local uint64_t psc_generation_seen;
+static atomic_uint psc_levels;
+
+// a helper function to get the levels whose tables are cached
+static unsigned pscLevels(void){
+    return atomic_load_explicit(&psc_levels, memory_order_relaxed);
+}
+
+// a helper function to get the VPN prefix that selects the table at the given level
+static uint64_t pscPrefix(uint64_t vpn, int level){
+    return vpn >> ((LEVELS - level) * BITS);
+}
+
+// a helper function to get the entry a table at the given level would be cached in
+static PscEntry* pscEntry(uint64_t pt, uint64_t prefix, int level){
+    return &psc[level][(prefix ^ pt) & (PSC_ENTRIES - 1)];
+}
+
+// a helper function to drop every cached table of the calling thread
+static void pscLocalFlush(void){
+    int level, i;
+    for(level = 1; level < LEVELS; level++){
+        for(i = 0; i < PSC_ENTRIES; i++){
+            psc[level][i].table = NULL;
+        }
+    }
+}
+
+// a helper function to move a fresh walk for vpn to the deepest cached table that
+// maps it, returns the level of that table (0 for the root). generation receives the
+// generation the lookup ran under, to be handed on to pscInsert(). Must be called
+// inside the walk's epoch.
+static int pscLookup(Walk* walk, uint64_t vpn, uint64_t* generation){
+    PscEntry* entry;
+    uint64_t prefix;
+    unsigned levels = pscLevels();
+    int level;
+    *generation = atomic_load(&psc_generation);
+    if(*generation != psc_generation_seen){
+        pscLocalFlush();
+        psc_generation_seen = *generation;
+    }
+    for(level = LEVELS - 1; level > 0; level--){
+        if(!(levels & (1U << level))){
+            continue;
+        }
+        prefix = pscPrefix(vpn, level);
+        entry = pscEntry(walk->pt, prefix, level);
+        if(entry->table != NULL && entry->prefix == prefix && entry->pt == walk->pt){
+            // walkTo() only reads the tables from depth - 1 down
+            walk->vpn = vpn;
+            walk->tables[level] = entry->table;
+            walk->depth = level + 1;
+            psc_hits[level]++;
+            return level;
+        }
+        psc_misses[level]++;
+    }
+    return 0;
+}
+
+// a helper function to cache the tables a walk went through below the given level.
+// They are dropped if a table was unlinked since the lookup that started the walk.
+static void pscInsert(Walk* walk, int level, uint64_t generation){
+    PscEntry* entry;
+    uint64_t prefix;
+    unsigned levels = pscLevels();
+    if(atomic_load(&psc_generation) != generation){
+        return;
+    }
+    for(level++; level < walk->depth; level++){
+        if(!(levels & (1U << level))){
+            continue;
+        }
+        prefix = pscPrefix(walk->vpn, level);
+        entry = pscEntry(walk->pt, prefix, level);
+        entry->pt = walk->pt;
+        entry->prefix = prefix;
+        entry->table = walk->tables[level];
+    }
+}
+
+void page_table_psc_enable(unsigned levels){
+    pscLocalFlush();
+    atomic_store(&psc_levels, levels & (((1U << LEVELS) - 1) & ~1U));
+}
+
+void page_table_psc_flush(void){
+    pscLocalFlush();
+    atomic_fetch_add(&psc_generation, 1);
+}
+
+void page_table_psc_stats(int level, uint64_t* hits, uint64_t* misses){
+    *hits = 0;
+    *misses = 0;
+    if(level > 0 && level < LEVELS){
+        *hits = psc_hits[level];
+        *misses = psc_misses[level];
+    }
+}
+
+// ================================== page table ==================================
+
+// Function to update the page table. Unmapping never allocates: it stops as soon as
+// it finds nothing mapped and frees the tables it empties.
+void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
+    Walk walk;
+    pte_t* pte;
+    uint64_t old = 0;
+    epochEnter();
+    walkInit(&walk, pt);
+    if (ppn == NO_MAPPING){
+        // look first, so that the shared tables on the way are only copied when
+        // there is a mapping to remove
+        walkTo(&walk, vpn, LEVELS - 1, 0);
+        if (walk.value & PTE_VALID){
+            walkInit(&walk, pt);
+            pte = walkTo(&walk, vpn, LEVELS - 1, WALK_SPLIT | WALK_UNSHARE);
+            if (walk.depth == LEVELS){
+                setPte(&walk, LEVELS - 1, pte, 0, &old);
+            }
+        }
+    }
+    else{
+        do{
+            pte = walkTo(&walk, vpn, LEVELS - 1, WALK_ALLOCATE | WALK_SPLIT | WALK_UNSHARE);
+        } while (pte == NULL || !setPte(&walk, LEVELS - 1, pte, (ppn << 12) | PTE_VALID, &old));
+    }
+    epochExit();
+    if (tlbEnabled() && (old & PTE_VALID)){
+        page_table_tlb_invalidate(pt, vpn);
+    }
 }
 
 // Function to query the page table
 uint64_t page_table_query(uint64_t pt, uint64_t vpn){
-    uint64_t index;
-    uint64_t pt_addr = pt << 12;
-    uint64_t *pt_pointer;
+    Walk walk;
+    uint64_t ppn;
+    uint64_t generation = 0;
+    uint64_t walked_generation = 0;
+    int cached_level = 0;
+    if(tlbEnabled() && tlbLookup(pt, vpn, &ppn, &generation)){
+        return ppn;
+    }
+    epochEnter();
+    walkInit(&walk, pt);
+    if(pscLevels()){
+        cached_level = pscLookup(&walk, vpn, &walked_generation);
+    }
+    walkTo(&walk, vpn, LEVELS - 1, 0);
+    ppn = walkTranslate(&walk, vpn);
+    if(pscLevels()){
+        pscInsert(&walk, cached_level, walked_generation);
+    }
+    epochExit();
+    if(tlbEnabled() && ppn != NO_MAPPING){
+        tlbInsert(pt, vpn, ppn, generation);
+    }
+    return ppn;
+}
+
+// ================================== batched operations ==================================
+
+// a helper function to pick the level of the largest leaf that can map the start of
+// a run of count pages at vpn -> ppn (any level when unmapping)
+static int rangeLevel(uint64_t vpn, uint64_t ppn, uint64_t count){
     int level;
-    for(level = 0; level <= 4; level++){
-        pt_pointer =  (uint64_t *)phys_to_virt(pt_addr);
+    for(level = HUGE_MIN_LEVEL; level < LEVELS - 1; level++){
+        uint64_t span = levelSpan(level);
+        if(count >= span && vpn % span == 0 && (ppn == NO_MAPPING || ppn % span == 0)){
+            return level;
+        }
+    }
+    return LEVELS - 1;
+}
 
-        index = (vpn >> ((4 - level) * 9)) & 0x1FF;
-        if(!(pt_pointer[index] & 1)){
-            return NO_MAPPING;
+// a helper function to fill the walk's last level table from index on with up to
+// count consecutive leaves starting at ppn (or clear them), reserving the new entries
+// with a single update of the table's count. Returns the number of entries done,
+// which falls short when the table was unlinked under us.
+static uint64_t fillLeaves(Walk* walk, uint64_t index, uint64_t count, uint64_t ppn){
+    pte_t* leaf = walk->tables[LEVELS - 1];
+    uint64_t end = index + count < ENTRIES ? index + count : ENTRIES;
+    uint64_t reserved = 0;
+    uint64_t mask[MASK_WORDS];
+    uint64_t bits;
+    uint64_t i;
+    uint64_t word;
+    tableMask(leaf, mask);
+    if(ppn == NO_MAPPING){
+        for(word = index / 64; word * 64 < end; word++){
+            for(bits = mask[word]; bits != 0; bits &= bits - 1){
+                i = word * 64 + __builtin_ctzll(bits);
+                if(i >= index && i < end){
+                    reserved += atomic_exchange_explicit(&leaf[i], 0, memory_order_acq_rel) & PTE_VALID;
+                }
+            }
         }
-        pt_addr = pt_pointer[index] - 1;
+        releaseEntries(walk, LEVELS - 1, reserved);
+        return end - index;
+    }
+    reserved = (end - index) - maskCount(mask, index, end);
+    if(!reserveEntries(walk, LEVELS - 1, reserved)){
+        return 0;
     }
-    return pt_pointer[index] >> 12;
+    for(i = index; i < end; i++){
+        if(atomic_exchange_explicit(&leaf[i], ((ppn + i - index) << 12) | PTE_VALID, memory_order_acq_rel) & PTE_VALID){
+            continue;
+        }
+        if(reserved > 0){
+            reserved--;
+        }
+        else if(!reserveEntries(walk, LEVELS - 1, 1)){
+            // unmapped and unlinked since we counted, redo this entry in a new table
+            return i - index;
+        }
+    }
+    // entries that became valid under us did not need their reservation
+    releaseEntries(walk, LEVELS - 1, reserved);
+    return end - index;
+}
 
+// Function to map count consecutive VPNs to consecutive PPNs (or unmap them all when
+// ppn_start is NO_MAPPING), walking the upper levels once per last level table.
+// Aligned 1 GiB and 2 MiB runs are mapped by a single huge leaf, replacing whatever
+// tables were below it. Unmapping skips whole subtrees that are not mapped.
+void page_table_update_range(uint64_t pt, uint64_t vpn_start, uint64_t count, uint64_t ppn_start){
+    Walk walk;
+    pte_t* pte;
+    uint64_t vpn;
+    uint64_t ppn;
+    uint64_t span;
+    uint64_t old;
+    uint64_t done = 0;
+    int level;
+    epochEnter();
+    walkInit(&walk, pt);
+    while(done < count){
+        vpn = vpn_start + done;
+        ppn = ppn_start == NO_MAPPING ? NO_MAPPING : ppn_start + done;
+        level = rangeLevel(vpn, ppn, count - done);
+        if(ppn != NO_MAPPING && level == LEVELS - 1 && vpn % ENTRIES == 0 && count - done >= ENTRIES){
+            // a whole last level table that no huge leaf can map, build it in one go
+            pte = walkTo(&walk, vpn, LEVELS - 2, WALK_ALLOCATE | WALK_SPLIT | WALK_UNSHARE);
+            if(pte == NULL){
+                continue;
+            }
+            if(!(walk.value & PTE_VALID) && installLeaves(&walk, pte, walk.value, ppn)){
+                done += ENTRIES;
+                continue;
+            }
+        }
+        if(ppn == NO_MAPPING){
+            pte = walkTo(&walk, vpn, level, WALK_SPLIT | WALK_UNSHARE);
+            if(walk.depth - 1 < level){
+                // nothing is mapped in the rest of this subtree
+                span = levelSpan(walk.depth - 1);
+                done += span - (vpn & (span - 1));
+                continue;
+            }
+        }
+        else{
+            pte = walkTo(&walk, vpn, level, WALK_ALLOCATE | WALK_SPLIT | WALK_UNSHARE);
+            if(pte == NULL){
+                continue;
+            }
+        }
+        if(level < LEVELS - 1){
+            if(setPte(&walk, level, pte, ppn == NO_MAPPING ? 0 : (ppn << 12) | PTE_HUGE | PTE_VALID, &old)){
+                done += levelSpan(level);
+            }
+            continue;
+        }
+        // fill the rest of this last level table in one go
+        done += fillLeaves(&walk, levelIndex(vpn, LEVELS - 1), count - done, ppn);
+    }
+    epochExit();
+    if(tlbEnabled()){
+        page_table_tlb_flush();
+    }
+}
+
+// Function to translate n VPNs at once; out[i] receives the PPN of vpns[i] or
+// NO_MAPPING. Neighboring VPNs share the walk of their common upper levels.
+void page_table_query_batch(uint64_t pt, const uint64_t* vpns, uint64_t* out, uint64_t n){
+    Walk walk;
+    uint64_t generation = 0;
+    uint64_t i;
+    epochEnter();
+    walkInit(&walk, pt);
+    for(i = 0; i < n; i++){
+        if(tlbEnabled() && tlbLookup(pt, vpns[i], &out[i], &generation)){
+            continue;
+        }
+        walkTo(&walk, vpns[i], LEVELS - 1, 0);
+        out[i] = walkTranslate(&walk, vpns[i]);
+        if(tlbEnabled() && out[i] != NO_MAPPING){
+            tlbInsert(pt, vpns[i], out[i], generation);
+        }
+    }
+    epochExit();
+}
+
+// ================================== cloning ==================================
+
+// Function to create a page table with the same mappings as pt, sharing every table
+// below the root with it. From then on the two change independently: an update first
+// copies the shared tables on its path, so memory only grows with the part of the
+// trie that diverges. No other thread may update pt while it is being cloned.
+uint64_t page_table_clone(uint64_t pt){
+    uint64_t new_pt = alloc_page_frame();
+    pte_t* source = (pte_t *)phys_to_virt(pt << 12);
+    pte_t* root = (pte_t *)phys_to_virt(new_pt << 12);
+    uint64_t pte;
+    int index;
+    for(index = 0; index < ENTRIES; index++){
+        pte = atomic_load_explicit(&source[index], memory_order_acquire);
+        if((pte & PTE_VALID) && pteIsTable(pte, 0)){
+            if(!(pte & PTE_COW)){
+                pte |= PTE_COW;
+                atomic_store_explicit(&source[index], pte, memory_order_release);
+            }
+            shareInc(pteFrame(pte));
+        }
+        atomic_store_explicit(&root[index], pte, memory_order_relaxed);
+    }
+    return new_pt;
+}
+
+// Function to drop every mapping of pt and hand its root and every table no other
+// page table shares back to free_page_frame(). pt must not be used afterwards.
+void page_table_destroy(uint64_t pt){
+    pte_t* root = (pte_t *)phys_to_virt(pt << 12);
+    uint64_t pte;
+    int index;
+    epochEnter();
+    for(index = 0; index < ENTRIES; index++){
+        pte = atomic_exchange_explicit(&root[index], 0, memory_order_acq_rel);
+        if((pte & PTE_VALID) && pteIsTable(pte, 0)){
+            releaseTable(pte, 0);
+        }
+    }
+    // the root is empty now, so this frees just the root
+    retireTable(pt, 0);
+    epochExit();
+    // the root frame may come back as another page table
+    if(tlbEnabled()){
+        page_table_tlb_flush();
+    }
+}
+
+// ================================== range scan ==================================
+
+// a helper function to call cb for every mapping in [lo, hi) below the table at the
+// given level that maps the VPNs starting at base. Only the valid entries are looked
+// at, found by scanning the table's mask a word at a time.
+static int forEachTable(pte_t* table, int level, uint64_t base, uint64_t lo, uint64_t hi,
+                        page_table_cb cb, void* arg){
+    uint64_t span = levelSpan(level);
+    uint64_t first = lo > base ? (lo - base) / span : 0;
+    uint64_t last = (hi - 1 - base) / span < ENTRIES - 1 ? (hi - 1 - base) / span : ENTRIES - 1;
+    uint64_t mask[MASK_WORDS];
+    uint64_t bits;
+    uint64_t pte;
+    uint64_t vpn;
+    uint64_t start;
+    uint64_t end;
+    uint64_t index;
+    int word;
+    int ret;
+    tableMask(table, mask);
+    for(word = first / 64; word <= (int)(last / 64); word++){
+        bits = mask[word];
+        if(word == (int)(first / 64)){
+            bits &= ~0ULL << (first % 64);
+        }
+        if(word == (int)(last / 64) && last % 64 != 63){
+            bits &= (1ULL << (last % 64 + 1)) - 1;
+        }
+        for(; bits != 0; bits &= bits - 1){
+            index = word * 64 + __builtin_ctzll(bits);
+            pte = atomic_load_explicit(&table[index], memory_order_acquire);
+            if(!(pte & PTE_VALID)){
+                // unmapped since we built the mask
+                continue;
+            }
+            vpn = base + index * span;
+            if(pteIsTable(pte, level)){
+                ret = forEachTable(pteTable(pte), level + 1, vpn, lo, hi, cb, arg);
+            }
+            else{
+                start = vpn > lo ? vpn : lo;
+                end = vpn + span < hi ? vpn + span : hi;
+                ret = cb(start, (pte >> 12) + (start - vpn), end - start, arg);
+            }
+            if(ret != 0){
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to call cb for every mapping of a VPN in [vpn_lo, vpn_hi), in VPN order
+// (vpn_hi may be NO_MAPPING for no upper bound).
+// A huge leaf is reported once, as a run of the pages it maps inside the range. The
+// scan stops at the first nonzero value cb returns and hands it back, else returns 0.
+// Mappings that change during the scan may or may not be reported.
+int page_table_for_each(uint64_t pt, uint64_t vpn_lo, uint64_t vpn_hi, page_table_cb cb, void* arg){
+    int ret;
+    if(vpn_hi > VPN_LIMIT){
+        vpn_hi = VPN_LIMIT;
+    }
+    if(vpn_lo >= vpn_hi){
+        return 0;
+    }
+    epochEnter();
+    ret = forEachTable((pte_t *)phys_to_virt(pt << 12), 0, 0, vpn_lo, vpn_hi, cb, arg);
+    epochExit();
+    return ret;
+}
+
+// ================================== snapshots ==================================
+// A snapshot is a header followed by the mappings as sorted runs of consecutive VPNs
+// that map to consecutive PPNs, so a huge leaf or a contiguous range is one record.
+// Loading replays the runs through page_table_update_range(), which puts the huge
+// leaves back and fills each last level table with a single walk.
+#define SNAPSHOT_MAGIC 0x3130534E55525450ULL    // "PTRUNS01"
+
+typedef struct SnapshotRun {
+    uint64_t vpn;
+    uint64_t ppn;
+    uint64_t count;
+} SnapshotRun;
+
+typedef struct SnapshotHeader {
+    uint64_t magic;
+    uint64_t runs;
+} SnapshotHeader;
+
+typedef struct SnapshotWriter {
+    FILE* file;
+    SnapshotRun run;    // the run being extended, empty when count is 0
+    uint64_t runs;
+    int error;
+} SnapshotWriter;
+
+// a helper function to add count pages vpn -> ppn to the snapshot, extending the
+// current run when they continue it
+static void snapshotAdd(SnapshotWriter* writer, uint64_t vpn, uint64_t ppn, uint64_t count){
+    SnapshotRun* run = &writer->run;
+    if(run->count > 0 && run->vpn + run->count == vpn && run->ppn + run->count == ppn){
+        run->count += count;
+        return;
+    }
+    if(run->count > 0){
+        writer->error |= fwrite(run, sizeof(*run), 1, writer->file) != 1;
+        writer->runs++;
+    }
+    run->vpn = vpn;
+    run->ppn = ppn;
+    run->count = count;
+}
+
+// a helper function to add a mapping reported by page_table_for_each()
+static int snapshotMapping(uint64_t vpn, uint64_t ppn, uint64_t count, void* arg){
+    snapshotAdd(arg, vpn, ppn, count);
+    return 0;
+}
+
+// Function to write every mapping of pt to path. Mappings that change while the
+// snapshot is taken may or may not make it in. Returns 0, or -1 with errno set.
+int page_table_save(uint64_t pt, const char* path){
+    SnapshotWriter writer = { .file = fopen(path, "wb") };
+    SnapshotHeader header = { SNAPSHOT_MAGIC, 0 };
+    if(writer.file == NULL){
+        return -1;
+    }
+    // the run count is filled in once it is known
+    writer.error = fwrite(&header, sizeof(header), 1, writer.file) != 1;
+    page_table_for_each(pt, 0, VPN_LIMIT, snapshotMapping, &writer);
+    snapshotAdd(&writer, NO_MAPPING, NO_MAPPING, 0);
+    header.runs = writer.runs;
+    writer.error |= fseek(writer.file, 0, SEEK_SET) != 0;
+    writer.error |= fwrite(&header, sizeof(header), 1, writer.file) != 1;
+    writer.error |= fclose(writer.file) != 0;
+    return writer.error ? -1 : 0;
+}
+
+// Function to build a new page table from a snapshot written by page_table_save().
+// Returns its root, or NO_MAPPING with errno set if the file can't be read, is not a
+// snapshot or maps VPNs this shape of page table has no room for.
+uint64_t page_table_load(const char* path){
+    struct stat st;
+    SnapshotHeader* header;
+    SnapshotRun* runs;
+    uint64_t pt;
+    uint64_t i;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return NO_MAPPING;
+    }
+    if(fstat(fd, &st) < 0 || (uint64_t)st.st_size < sizeof(SnapshotHeader)){
+        close(fd);
+        errno = EINVAL;
+        return NO_MAPPING;
+    }
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(header == MAP_FAILED){
+        return NO_MAPPING;
+    }
+    if(header->magic != SNAPSHOT_MAGIC ||
+       header->runs != (st.st_size - sizeof(SnapshotHeader)) / sizeof(SnapshotRun)){
+        munmap(header, st.st_size);
+        errno = EINVAL;
+        return NO_MAPPING;
+    }
+    madvise(header, st.st_size, MADV_SEQUENTIAL);
+    runs = (SnapshotRun *)(header + 1);
+    for(i = 0; i < header->runs; i++){
+        if(runs[i].vpn >= VPN_LIMIT || runs[i].count > VPN_LIMIT - runs[i].vpn){
+            munmap(header, st.st_size);
+            errno = EINVAL;
+            return NO_MAPPING;
+        }
+    }
+    pt = alloc_page_frame();
+    for(i = 0; i < header->runs; i++){
+        page_table_update_range(pt, runs[i].vpn, runs[i].count, runs[i].ppn);
+    }
+    munmap(header, st.st_size);
+    return pt;
 }
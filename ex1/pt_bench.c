@@ -0,0 +1,1349 @@
+/*
+ * Page table benchmarks.
+ *
+ *	gcc -O3 -std=c11 -pthread -o pt_bench pt_bench.c pt.c pt_hash.c -lm
+ *	./pt_bench [-f TRACE] [benchmark...]
+ *
+ * Add -DFRAME_ARENA (and optionally -DFRAME_ARENA_HUGETLB) to take the frames
+ * from one big region instead of mapping them one at a time, and -DPT_LEVELS=n
+ * -DPT_BITS=b to measure another shape of page table (see os.h).
+ *
+ * With no benchmarks named every benchmark is run. "-f TRACE" adds a recorded
+ * trace to the "traces" benchmark, see trace_load() for the format.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <time.h>
+#include <math.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "os.h"
+
+/* 2^20 pages ought to be enough for anybody */
+#define NPAGES (1024 * 1024)
+
+#ifdef FRAME_ARENA
+/*
+ * All frames are carved out of one region reserved up front, so phys_to_virt()
+ * is an offset instead of a table lookup. Only the frames that get touched are
+ * backed by memory. Build with -DFRAME_ARENA_HUGETLB to back the region with
+ * explicit huge pages, otherwise transparent huge pages are asked for.
+ */
+#define ARENA_BASE	(0xbaaaaaadULL << 12)
+#define ARENA_SIZE	((uint64_t)NPAGES * 4096)
+
+static char *arena;
+
+static void arena_init(void)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+#ifdef FRAME_ARENA_HUGETLB
+	/* without MAP_NORESERVE this fails up front instead of faulting later */
+	arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (arena != MAP_FAILED)
+		return;
+	warnx("no huge pages for the frame arena, falling back to 4 KiB pages");
+#endif
+	arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (arena == MAP_FAILED)
+		err(1, "mmap failed");
+	madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+}
+#else
+static char *pages[NPAGES];
+#endif
+static uint64_t nalloc;
+
+/* the page table may allocate and free from several threads at once */
+static mtx_t frame_lock;
+
+/* frames handed back by free_page_frame(), linked through their first word */
+static uint64_t free_frames = NO_MAPPING;
+static uint64_t nfree;
+
+uint64_t alloc_page_frame(void)
+{
+	uint64_t ppn;
+	void *va;
+
+	mtx_lock(&frame_lock);
+	if (free_frames != NO_MAPPING) {
+		ppn = free_frames;
+		va = phys_to_virt(ppn << 12);
+		free_frames = *(uint64_t *)va;
+		nfree--;
+		mtx_unlock(&frame_lock);
+		memset(va, 0, 4096);
+		return ppn;
+	}
+
+	if (nalloc == NPAGES)
+		errx(1, "out of physical memory");
+
+	ppn = nalloc;
+	nalloc++;
+
+#ifdef FRAME_ARENA
+	if (arena == NULL)
+		arena_init();
+#else
+	va = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (va == MAP_FAILED)
+		err(1, "mmap failed");
+
+	pages[ppn] = va;
+#endif
+	mtx_unlock(&frame_lock);
+	return ppn + 0xbaaaaaad;
+}
+
+void *phys_to_virt(uint64_t phys_addr)
+{
+#ifdef FRAME_ARENA
+	uint64_t off = phys_addr - ARENA_BASE;
+
+	return off < ARENA_SIZE ? arena + off : NULL;
+#else
+	uint64_t ppn = (phys_addr >> 12) - 0xbaaaaaad;
+	uint64_t off = phys_addr & 0xfff;
+	char *va = NULL;
+
+	if (ppn < NPAGES)
+		va = pages[ppn] + off;
+
+	return va;
+#endif
+}
+
+void free_page_frame(uint64_t ppn)
+{
+	uint64_t *frame = phys_to_virt(ppn << 12);
+
+	mtx_lock(&frame_lock);
+	*frame = free_frames;
+	free_frames = ppn;
+	nfree++;
+	mtx_unlock(&frame_lock);
+}
+
+static uint64_t frames_in_use(void)
+{
+	uint64_t n;
+
+	mtx_lock(&frame_lock);
+	n = nalloc - nfree;
+	mtx_unlock(&frame_lock);
+	return n;
+}
+
+#ifdef FRAME_ARENA
+/*
+ * A frame image is the allocator state followed by every frame handed out so
+ * far. Loading it is a single private mapping of the file over the start of
+ * the arena, after which the page tables saved in it are usable as they are.
+ * No page table may be in use while an image is loaded.
+ */
+#define FRAME_IMAGE_MAGIC 0x31304547414d4946ULL	/* "FIMAGE01" */
+
+struct frame_image {
+	uint64_t magic;
+	uint64_t nalloc;
+	uint64_t nfree;
+	uint64_t free_frames;
+	uint64_t pt;
+	char pad[4096 - 5 * sizeof(uint64_t)];
+};
+
+static void frame_image_save(const char *path, uint64_t pt)
+{
+	struct frame_image header = { .magic = FRAME_IMAGE_MAGIC };
+	FILE *f = fopen(path, "wb");
+
+	if (f == NULL)
+		err(1, "%s", path);
+
+	mtx_lock(&frame_lock);
+	header.nalloc = nalloc;
+	header.nfree = nfree;
+	header.free_frames = free_frames;
+	header.pt = pt;
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+	    fwrite(arena, 4096, nalloc, f) != nalloc)
+		err(1, "%s", path);
+	mtx_unlock(&frame_lock);
+
+	if (fclose(f) != 0)
+		err(1, "%s", path);
+}
+
+/* returns the page table the image was saved with */
+static uint64_t frame_image_load(const char *path)
+{
+	struct frame_image header;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		err(1, "%s", path);
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+	    header.magic != FRAME_IMAGE_MAGIC || header.nalloc > NPAGES)
+		errx(1, "%s: not a frame image", path);
+
+	mtx_lock(&frame_lock);
+	if (arena == NULL)
+		arena_init();
+	if (header.nalloc > 0 &&
+	    mmap(arena, header.nalloc * 4096, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, fd, sizeof(header)) == MAP_FAILED)
+		err(1, "%s", path);
+	nalloc = header.nalloc;
+	nfree = header.nfree;
+	free_frames = header.free_frames;
+	mtx_unlock(&frame_lock);
+
+	close(fd);
+	return header.pt;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+static _Thread_local uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* VPNs live in a 45 bit space, or whatever PT_LEVELS and PT_BITS make it */
+#define VPN_MASK ((1ULL << (PT_LEVELS * PT_BITS)) - 1)
+
+/*
+ * The start of the i-th of a set of distinct runs of run pages (a power of
+ * two) scattered over the VPN space: an odd multiplier permutes the run slots.
+ */
+static uint64_t run_base(uint64_t i, uint64_t run)
+{
+	return (i * 0x9e3779b97f4a7c15ULL & (VPN_MASK / run)) * run;
+}
+
+/*
+ * Build a page table from scratch the way trace setup does, with frames that
+ * the allocator has not handed out before, then look every page up once.
+ * Compare builds with and without -DFRAME_ARENA.
+ */
+#define SETUP_PAGES	(64 * 1024)
+
+static void bench_setup(void)
+{
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns = malloc(SETUP_PAGES * sizeof(*vpns));
+	uint64_t fresh = nalloc;
+	uint64_t sum = 0;
+	double t, map, query;
+	int i;
+
+	/* the low bits keep the pages apart in small VPN spaces too */
+	for (i = 0; i < SETUP_PAGES; i++)
+		vpns[i] = (rng() & VPN_MASK & ~(SETUP_PAGES - 1ULL)) | i;
+
+	t = now();
+	for (i = 0; i < SETUP_PAGES; i++)
+		page_table_update(pt, vpns[i], i);
+	map = now() - t;
+	fresh = nalloc - fresh;
+
+	t = now();
+	for (i = 0; i < SETUP_PAGES; i++)
+		sum += page_table_query(pt, vpns[i]);
+	query = now() - t;
+	if (sum != (uint64_t)SETUP_PAGES * (SETUP_PAGES - 1) / 2)
+		errx(1, "setup: wrong translations");
+
+#ifdef FRAME_ARENA
+	printf("setup: %d random pages, arena allocator\n", SETUP_PAGES);
+#else
+	printf("setup: %d random pages, mmap per frame\n", SETUP_PAGES);
+#endif
+	printf("  map:   %6.1f ns/page (%llu new frames)\n", map * 1e9 / SETUP_PAGES,
+	       (unsigned long long)fresh);
+	printf("  query: %6.1f ns/page\n", query * 1e9 / SETUP_PAGES);
+
+	page_table_destroy(pt);
+	free(vpns);
+}
+
+/*
+ * Replay a lookup trace with a hot working set, first with the plain walk and
+ * then through the software TLB.
+ */
+#define TRACE_MAPPED	4096
+#define TRACE_HOT	64
+#define TRACE_LEN	(8 * 1024 * 1024)
+
+static void bench_tlb(void)
+{
+	uint64_t pt = alloc_page_frame();
+	uint64_t *mapped = malloc(TRACE_MAPPED * sizeof(*mapped));
+	uint64_t *trace = malloc(TRACE_LEN * sizeof(*trace));
+	uint64_t hits, misses, sum;
+	double t, walk, cached;
+	int i;
+
+	for (i = 0; i < TRACE_MAPPED; i++) {
+		mapped[i] = rng() & VPN_MASK;
+		page_table_update(pt, mapped[i], i);
+	}
+	/* 90% of the lookups go to a small hot set */
+	for (i = 0; i < TRACE_LEN; i++) {
+		if (rng() % 10)
+			trace[i] = mapped[rng() % TRACE_HOT];
+		else
+			trace[i] = mapped[rng() % TRACE_MAPPED];
+	}
+
+	sum = 0;
+	t = now();
+	for (i = 0; i < TRACE_LEN; i++)
+		sum += page_table_query(pt, trace[i]);
+	walk = now() - t;
+
+	page_table_tlb_enable(1);
+	t = now();
+	for (i = 0; i < TRACE_LEN; i++)
+		sum -= page_table_query(pt, trace[i]);
+	cached = now() - t;
+	page_table_tlb_stats(&hits, &misses);
+	page_table_tlb_enable(0);
+
+	if (sum != 0)
+		errx(1, "tlb: translations differ from the walk");
+
+	printf("tlb: %d lookups, %d mapped, %d hot\n", TRACE_LEN, TRACE_MAPPED, TRACE_HOT);
+	printf("  walk: %6.1f ns/lookup\n", walk * 1e9 / TRACE_LEN);
+	printf("  tlb:  %6.1f ns/lookup (%llu hits, %llu misses, %.1f%% hit rate)\n",
+	       cached * 1e9 / TRACE_LEN, (unsigned long long)hits,
+	       (unsigned long long)misses, 100.0 * hits / (hits + misses));
+
+	page_table_destroy(pt);
+	free(trace);
+	free(mapped);
+}
+
+/*
+ * Replay a trace that stays inside a few 2 MiB regions for a while but touches
+ * far too many pages in them for the TLB, with the paging-structure cache
+ * caching only last level tables and then tables at every level.
+ */
+#define PSC_REGIONS	256
+#define PSC_RUN		16
+
+static double psc_replay(uint64_t pt, const uint64_t *trace, uint64_t *sum)
+{
+	double t = now();
+	int i;
+
+	for (i = 0; i < TRACE_LEN; i++)
+		*sum += page_table_query(pt, trace[i]);
+	return now() - t;
+}
+
+static void bench_psc(void)
+{
+	static const struct {
+		const char *name;
+		unsigned levels;
+	} configs[] = {
+		{ "leaf", 1U << (PT_LEVELS - 1) },
+		{ "all", (1U << PT_LEVELS) - 2 },
+	};
+	uint64_t pt = alloc_page_frame();
+	uint64_t *regions = malloc(PSC_REGIONS * sizeof(*regions));
+	uint64_t *trace = malloc(TRACE_LEN * sizeof(*trace));
+	uint64_t hits, misses, sum, expected, base = 0;
+	double walk, t;
+	size_t c;
+	int i, level;
+
+	for (i = 0; i < PSC_REGIONS; i++) {
+		regions[i] = run_base(i, 512);
+		page_table_update_range(pt, regions[i], 512, 1);
+	}
+	/* runs of lookups at random pages of one region */
+	for (i = 0; i < TRACE_LEN; i++) {
+		if (i % PSC_RUN == 0)
+			base = regions[rng() % PSC_REGIONS];
+		trace[i] = base + rng() % 512;
+	}
+
+	expected = 0;
+	walk = psc_replay(pt, trace, &expected);
+	printf("psc: %d lookups, %d regions of 512 pages, runs of %d\n", TRACE_LEN,
+	       PSC_REGIONS, PSC_RUN);
+	printf("  walk: %6.1f ns/lookup\n", walk * 1e9 / TRACE_LEN);
+
+	for (c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+		uint64_t before[PT_LEVELS][2];
+
+		page_table_psc_enable(configs[c].levels);
+		for (level = 1; level < PT_LEVELS; level++)
+			page_table_psc_stats(level, &before[level][0], &before[level][1]);
+		sum = 0;
+		t = psc_replay(pt, trace, &sum);
+		page_table_psc_enable(0);
+		if (sum != expected)
+			errx(1, "psc: translations differ from the walk");
+
+		printf("  %-5s %6.1f ns/lookup, hit rate by level:", configs[c].name,
+		       t * 1e9 / TRACE_LEN);
+		for (level = PT_LEVELS - 1; level > 0; level--) {
+			page_table_psc_stats(level, &hits, &misses);
+			hits -= before[level][0];
+			misses -= before[level][1];
+			if (hits + misses)
+				printf(" L%d %.1f%%", level, 100.0 * hits / (hits + misses));
+		}
+		printf("\n");
+	}
+
+	page_table_destroy(pt);
+	free(trace);
+	free(regions);
+}
+
+/*
+ * Map and query a contiguous VPN range one page at a time and through the
+ * batched entry points. The PPNs are misaligned so no huge leaves are used.
+ */
+#define RANGE_PAGES	(256 * 1024)
+
+static void bench_batch(void)
+{
+	uint64_t pt_single = alloc_page_frame();
+	uint64_t pt_range = alloc_page_frame();
+	uint64_t base = 0x123400000ULL;
+	uint64_t *vpns = malloc(RANGE_PAGES * sizeof(*vpns));
+	uint64_t *out = malloc(RANGE_PAGES * sizeof(*out));
+	double t, single, range;
+	uint64_t i;
+
+	t = now();
+	for (i = 0; i < RANGE_PAGES; i++)
+		page_table_update(pt_single, base + i, i + 1);
+	single = now() - t;
+	t = now();
+	page_table_update_range(pt_range, base, RANGE_PAGES, 1);
+	range = now() - t;
+	printf("batch: %d contiguous pages\n", RANGE_PAGES);
+	printf("  update:       %6.1f ns/page\n", single * 1e9 / RANGE_PAGES);
+	printf("  update_range: %6.1f ns/page\n", range * 1e9 / RANGE_PAGES);
+
+	for (i = 0; i < RANGE_PAGES; i++)
+		vpns[i] = base + i;
+	t = now();
+	for (i = 0; i < RANGE_PAGES; i++)
+		out[i] = page_table_query(pt_single, vpns[i]);
+	single = now() - t;
+	t = now();
+	page_table_query_batch(pt_range, vpns, out, RANGE_PAGES);
+	range = now() - t;
+	for (i = 0; i < RANGE_PAGES; i++) {
+		if (out[i] != i + 1)
+			errx(1, "batch: wrong translation for vpn %#llx", (unsigned long long)vpns[i]);
+	}
+	printf("  query:        %6.1f ns/page\n", single * 1e9 / RANGE_PAGES);
+	printf("  query_batch:  %6.1f ns/page\n", range * 1e9 / RANGE_PAGES);
+
+	page_table_destroy(pt_single);
+	page_table_destroy(pt_range);
+	free(out);
+	free(vpns);
+}
+
+/*
+ * Map 1 GiB with 4 KiB leaves (a misaligned PPN rules out huge leaves) and
+ * with a single 1 GiB leaf, then compare the frames used and lookup cost.
+ */
+#define HUGE_PAGES	(1ULL << 18)
+#define HUGE_LOOKUPS	(4 * 1024 * 1024)
+
+static void bench_huge_one(const char *name, uint64_t ppn_start)
+{
+	uint64_t pt = alloc_page_frame();
+	uint64_t base = 1ULL << 30;
+	uint64_t frames = frames_in_use();
+	uint64_t sum = 0;
+	double t, map;
+	int i;
+
+	t = now();
+	page_table_update_range(pt, base, HUGE_PAGES, ppn_start);
+	map = now() - t;
+	frames = frames_in_use() - frames;
+	t = now();
+	for (i = 0; i < HUGE_LOOKUPS; i++)
+		sum += page_table_query(pt, base + rng() % HUGE_PAGES);
+	t = now() - t;
+	printf("  %s: %6llu frames, map %8.3f ms, %6.1f ns/lookup (%llx)\n", name,
+	       (unsigned long long)frames, map * 1e3, t * 1e9 / HUGE_LOOKUPS,
+	       (unsigned long long)(sum & 0xf));
+	page_table_destroy(pt);
+}
+
+static void bench_huge(void)
+{
+	printf("huge: 1 GiB mapping, %d random lookups\n", HUGE_LOOKUPS);
+	bench_huge_one("4 KiB leaves", HUGE_PAGES + 1);
+	bench_huge_one("1 GiB leaf  ", HUGE_PAGES);
+}
+
+/*
+ * Build a table the way a trace would, snapshot it, and compare rebuilding it
+ * with loading the snapshot. The arena build also saves and maps back a flat
+ * image of the frames.
+ */
+#define SNAP_REGIONS	4096
+#define SNAP_RUN	64
+
+static void snap_check(uint64_t pt, const uint64_t *regions, const char *what)
+{
+	int i;
+
+	for (i = 0; i < SNAP_REGIONS; i++) {
+		if (page_table_query(pt, regions[i]) != (uint64_t)i * SNAP_RUN ||
+		    page_table_query(pt, regions[i] + SNAP_RUN - 1) != (uint64_t)(i + 1) * SNAP_RUN - 1)
+			errx(1, "snapshot: %s lost mappings", what);
+	}
+}
+
+static void bench_snapshot(void)
+{
+	const char *runs = "pt_bench.runs";
+	uint64_t pt = alloc_page_frame();
+	uint64_t *regions = malloc(SNAP_REGIONS * sizeof(*regions));
+	uint64_t loaded;
+	double t;
+	int i, j;
+
+	for (i = 0; i < SNAP_REGIONS; i++)
+		regions[i] = run_base(i, SNAP_RUN);
+
+	t = now();
+	for (i = 0; i < SNAP_REGIONS; i++) {
+		for (j = 0; j < SNAP_RUN; j++)
+			page_table_update(pt, regions[i] + j, (uint64_t)i * SNAP_RUN + j);
+	}
+	printf("snapshot: %d pages in runs of %d\n", SNAP_REGIONS * SNAP_RUN, SNAP_RUN);
+	printf("  rebuild:   %8.2f ms\n", (now() - t) * 1e3);
+
+	t = now();
+	if (page_table_save(pt, runs) != 0)
+		err(1, "%s", runs);
+	t = now() - t;
+	printf("  save runs: %8.2f ms\n", t * 1e3);
+	t = now();
+	loaded = page_table_load(runs);
+	if (loaded == NO_MAPPING)
+		err(1, "%s", runs);
+	t = now() - t;
+	printf("  load runs: %8.2f ms\n", t * 1e3);
+	snap_check(loaded, regions, "load");
+	page_table_destroy(loaded);
+	remove(runs);
+
+#ifdef FRAME_ARENA
+	{
+		const char *image = "pt_bench.image";
+
+		t = now();
+		frame_image_save(image, pt);
+		printf("  save image: %7.2f ms (%llu frames)\n", (now() - t) * 1e3,
+		       (unsigned long long)nalloc);
+		t = now();
+		pt = frame_image_load(image);
+		printf("  load image: %7.2f ms\n", (now() - t) * 1e3);
+		t = now();
+		snap_check(pt, regions, "image");
+		printf("  first use:  %7.2f ms\n", (now() - t) * 1e3);
+		remove(image);
+	}
+#endif
+
+	page_table_destroy(pt);
+	free(regions);
+}
+
+/*
+ * Count the resident pages of a sparse table with page_table_for_each(), next
+ * to querying every mapped VPN (which only works when the VPNs are known).
+ */
+static int scan_count(uint64_t vpn, uint64_t ppn, uint64_t count, void *arg)
+{
+	(void)vpn;
+	(void)ppn;
+	*(uint64_t *)arg += count;
+	return 0;
+}
+
+static void bench_scan(void)
+{
+	uint64_t pt = alloc_page_frame();
+	uint64_t *regions = malloc(SNAP_REGIONS * sizeof(*regions));
+	uint64_t rss = 0, mapped = 0;
+	double t, scan, query;
+	int i, j;
+
+	for (i = 0; i < SNAP_REGIONS; i++) {
+		regions[i] = run_base(i, SNAP_RUN);
+		page_table_update_range(pt, regions[i], SNAP_RUN, (uint64_t)i * SNAP_RUN + 1);
+	}
+
+	t = now();
+	page_table_for_each(pt, 0, NO_MAPPING, scan_count, &rss);
+	scan = now() - t;
+
+	t = now();
+	for (i = 0; i < SNAP_REGIONS; i++) {
+		for (j = 0; j < SNAP_RUN; j++)
+			mapped += page_table_query(pt, regions[i] + j) != NO_MAPPING;
+	}
+	query = now() - t;
+	if (rss != mapped)
+		errx(1, "scan: counted %llu pages, %llu are mapped",
+		     (unsigned long long)rss, (unsigned long long)mapped);
+
+	printf("scan: %llu pages in runs of %d\n", (unsigned long long)rss, SNAP_RUN);
+	printf("  for_each: %7.2f ms\n", scan * 1e3);
+	printf("  query:    %7.2f ms\n", query * 1e3);
+
+	page_table_destroy(pt);
+	free(regions);
+}
+
+/*
+ * Bulk operations whose inner loops are the table kernels, with the kernels
+ * capped at plain loops, SSE2 and AVX2 in turn: mapping whole last level
+ * tables, scanning them, splitting 2 MiB leaves and unmapping it all again.
+ */
+#define SIMD_PAGES	(256 * 1024)
+#define SIMD_ROUNDS	5
+
+static double simd_min(double a, double b)
+{
+	return b < a ? b : a;
+}
+
+static void bench_simd(void)
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+	uint64_t base = 0x5550000000ULL;
+	uint64_t pt, rss, i;
+	double t, map, scan, split, unmap;
+	int round, level, best = page_table_simd(-1);
+
+	printf("simd: %d pages, best of %d rounds\n", SIMD_PAGES, SIMD_ROUNDS);
+	for (level = 0; level <= best; level++) {
+		page_table_simd(level);
+		pt = alloc_page_frame();
+		map = scan = split = unmap = 1e9;
+		for (round = 0; round < SIMD_ROUNDS; round++) {
+			t = now();
+			page_table_update_range(pt, base, SIMD_PAGES, 1);
+			map = simd_min(map, now() - t);
+
+			rss = 0;
+			t = now();
+			page_table_for_each(pt, 0, NO_MAPPING, scan_count, &rss);
+			scan = simd_min(scan, now() - t);
+			if (rss != SIMD_PAGES)
+				errx(1, "simd: scanned %llu pages", (unsigned long long)rss);
+
+			page_table_update_range(pt, base, SIMD_PAGES, NO_MAPPING);
+			page_table_update_range(pt, base, SIMD_PAGES, 0);
+			t = now();
+			for (i = 0; i < SIMD_PAGES; i += 512)
+				page_table_update(pt, base + i + 7, 7);
+			split = simd_min(split, now() - t);
+			if (page_table_query(pt, base + 512 + 6) != 512 + 6)
+				errx(1, "simd: split lost a mapping");
+
+			t = now();
+			page_table_update_range(pt, base, SIMD_PAGES, NO_MAPPING);
+			unmap = simd_min(unmap, now() - t);
+		}
+		printf("  %-6s  map %5.2f  scan %5.2f  split %5.2f  unmap %5.2f ns/page\n",
+		       names[level], map * 1e9 / SIMD_PAGES, scan * 1e9 / SIMD_PAGES,
+		       split * 1e9 / SIMD_PAGES, unmap * 1e9 / SIMD_PAGES);
+		page_table_destroy(pt);
+	}
+	page_table_simd(-1);
+}
+
+/*
+ * Map and unmap random sparse pages round after round. Every round unmaps
+ * everything it mapped, so the frames in use should stay flat.
+ */
+#define CHURN_ROUNDS	8
+#define CHURN_PAGES	(16 * 1024)
+
+static void bench_churn(void)
+{
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns = malloc(CHURN_PAGES * sizeof(*vpns));
+	uint64_t base = frames_in_use();
+	uint64_t peak;
+	double t;
+	int round, i;
+
+	printf("churn: %d rounds of %d random maps and unmaps\n", CHURN_ROUNDS, CHURN_PAGES);
+	for (round = 0; round < CHURN_ROUNDS; round++) {
+		t = now();
+		for (i = 0; i < CHURN_PAGES; i++) {
+			vpns[i] = rng() & VPN_MASK;
+			page_table_update(pt, vpns[i], i);
+		}
+		peak = frames_in_use() - base;
+		for (i = 0; i < CHURN_PAGES; i++)
+			page_table_update(pt, vpns[i], NO_MAPPING);
+		t = now() - t;
+		printf("  round %d: %6llu frames mapped, %llu left after unmap, %6.1f ns/op\n",
+		       round, (unsigned long long)peak,
+		       (unsigned long long)(frames_in_use() - base), t * 1e9 / (2 * CHURN_PAGES));
+	}
+
+	page_table_destroy(pt);
+	free(vpns);
+}
+
+/*
+ * fork() of a parent with SNAP_REGIONS runs of SNAP_RUN pages: mapping every
+ * run again into a new root against page_table_clone(), then the frames the
+ * clone needs once the child has written to FORK_WRITES of its pages.
+ */
+#define FORK_WRITES	(SNAP_REGIONS * SNAP_RUN / 100)
+
+static int fork_copy(uint64_t vpn, uint64_t ppn, uint64_t count, void *arg)
+{
+	page_table_update_range(*(uint64_t *)arg, vpn, count, ppn);
+	return 0;
+}
+
+static void bench_fork(void)
+{
+	uint64_t parent = alloc_page_frame();
+	uint64_t *regions = malloc(SNAP_REGIONS * sizeof(*regions));
+	uint64_t base, copy, child, copied, cloned;
+	double t, t_copy, t_clone;
+	int i;
+
+	for (i = 0; i < SNAP_REGIONS; i++) {
+		regions[i] = run_base(i, SNAP_RUN);
+		page_table_update_range(parent, regions[i], SNAP_RUN, (uint64_t)i * SNAP_RUN + 1);
+	}
+
+	base = frames_in_use();
+	t = now();
+	copy = alloc_page_frame();
+	page_table_for_each(parent, 0, NO_MAPPING, fork_copy, &copy);
+	t_copy = now() - t;
+	copied = frames_in_use() - base;
+
+	base = frames_in_use();
+	t = now();
+	child = page_table_clone(parent);
+	t_clone = now() - t;
+	cloned = frames_in_use() - base;
+
+	printf("fork: %d runs of %d pages\n", SNAP_REGIONS, SNAP_RUN);
+	printf("  copy:  %9.1f us %7llu frames\n", t_copy * 1e6, (unsigned long long)copied);
+	printf("  clone: %9.1f us %7llu frames\n", t_clone * 1e6, (unsigned long long)cloned);
+
+	t = now();
+	for (i = 0; i < FORK_WRITES; i++)
+		page_table_update(child, regions[rng() % SNAP_REGIONS] + rng() % SNAP_RUN, i);
+	t = now() - t;
+	printf("  %d writes to the clone: %6.1f ns/write, %llu frames\n", FORK_WRITES,
+	       t * 1e9 / FORK_WRITES, (unsigned long long)(frames_in_use() - base));
+
+	base -= copied;
+	page_table_destroy(copy);
+	page_table_destroy(child);
+	if (frames_in_use() != base)
+		errx(1, "fork: %lld frames leaked", (long long)(frames_in_use() - base));
+	page_table_destroy(parent);
+	free(regions);
+}
+
+/*
+ * Several threads share one page table. Every thread owns a block of VPNs
+ * that only it maps and unmaps, and checks its own translations, while it
+ * also looks up VPNs of every other block. Reports the throughput from 1 up
+ * to MAX(4, #cpus) threads.
+ */
+#define SCALE_BLOCK	4096
+#define SCALE_OPS	(1024 * 1024)
+#define SCALE_MAX	64
+
+struct scale_arg {
+	uint64_t pt;
+	int id;
+	int nthreads;
+};
+
+static _Atomic int scale_start;
+
+static uint64_t scale_vpn(int id, uint64_t i)
+{
+	/* blocks share the upper levels but not the leaf tables */
+	return ((uint64_t)id << 20) + i;
+}
+
+static int scale_thread(void *p)
+{
+	struct scale_arg *arg = p;
+	uint64_t *ppns = calloc(SCALE_BLOCK, sizeof(*ppns));
+	uint64_t i, vpn, ppn;
+	int op;
+
+	rng_state ^= (uint64_t)(arg->id + 1) * 0x9e3779b97f4a7c15ULL;
+	for (i = 0; i < SCALE_BLOCK; i++) {
+		ppns[i] = i;
+		page_table_update(arg->pt, scale_vpn(arg->id, i), i);
+	}
+	atomic_fetch_add(&scale_start, 1);
+	while (atomic_load(&scale_start) < arg->nthreads)
+		thrd_yield();
+
+	for (op = 0; op < SCALE_OPS; op++) {
+		uint64_t r = rng();
+
+		i = (r >> 8) % SCALE_BLOCK;
+		if (r % 10 == 0) {
+			/* 10% updates of our own block, a third of them unmaps */
+			vpn = scale_vpn(arg->id, i);
+			ppn = (r >> 4) % 3 ? r >> 40 : NO_MAPPING;
+			page_table_update(arg->pt, vpn, ppn);
+			ppns[i] = ppn;
+		} else if (r % 10 < 5) {
+			vpn = scale_vpn(arg->id, i);
+			if (page_table_query(arg->pt, vpn) != ppns[i])
+				errx(1, "threads: wrong translation for vpn %#llx", (unsigned long long)vpn);
+		} else {
+			page_table_query(arg->pt, scale_vpn((r >> 32) % arg->nthreads, i));
+		}
+	}
+
+	free(ppns);
+	return 0;
+}
+
+static void bench_threads(void)
+{
+	thrd_t threads[SCALE_MAX];
+	struct scale_arg args[SCALE_MAX];
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max = ncpus > 4 ? (ncpus < SCALE_MAX ? ncpus : SCALE_MAX) : 4;
+	double t, base = 0;
+	int n, i;
+
+	printf("threads: %d ops per thread, 50%% own lookups, 40%% shared lookups, 10%% updates\n",
+	       SCALE_OPS);
+	for (n = 1; n <= max; n *= 2) {
+		uint64_t pt = alloc_page_frame();
+
+		atomic_store(&scale_start, 0);
+		for (i = 0; i < n; i++) {
+			args[i] = (struct scale_arg){ pt, i, n };
+			if (thrd_create(&threads[i], scale_thread, &args[i]) != thrd_success)
+				errx(1, "thrd_create failed");
+		}
+		/* the clock includes the setup maps, which is small next to the ops */
+		t = now();
+		for (i = 0; i < n; i++)
+			thrd_join(threads[i], NULL);
+		t = now() - t;
+		if (n == 1)
+			base = t;
+		printf("  %2d threads: %7.2f Mops/s (%.2fx)\n", n, n * SCALE_OPS / t / 1e6,
+		       n * base / t);
+		page_table_destroy(pt);
+		if (n * 2 > max && n != max)
+			n = max / 2;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Trace replay. A trace is a list of maps, unmaps and lookups against one or
+ * two page tables (two for fork-like copies), replayed with every operation
+ * timed in TSC cycles. Besides the synthetic patterns, "-f FILE" replays a
+ * recorded trace with one operation per line, VPNs and PPNs in hex:
+ *
+ *	m VPN PPN	map VPN to PPN
+ *	u VPN		unmap VPN
+ *	q VPN		look VPN up
+ *
+ * Lines starting with '#' are skipped.
+ */
+#define TRACE_OPS	(1024 * 1024)
+#define ZIPF_THETA	0.99
+
+enum { OP_QUERY, OP_MAP, OP_UNMAP, OP_CLONE };
+
+struct trace_op {
+	uint64_t vpn;
+	uint64_t ppn;
+	uint8_t type;
+	uint8_t space;		/* which of the two page tables, OP_CLONE replaces 1 by a clone of 0 */
+};
+
+struct trace {
+	const char *name;
+	struct trace_op *ops;
+	size_t n, cap;
+};
+
+static const char *trace_file;
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return now() * 1e9;
+#endif
+}
+
+/* TSC cycles per second, measured once */
+static double cycles_per_sec(void)
+{
+	static double hz;
+	double t;
+	uint64_t c;
+
+	if (hz == 0) {
+		t = now();
+		c = cycles();
+		while (now() - t < 0.05)
+			;
+		hz = (cycles() - c) / (now() - t);
+	}
+	return hz;
+}
+
+static void trace_add(struct trace *tr, int type, int space, uint64_t vpn, uint64_t ppn)
+{
+	if (tr->n == tr->cap) {
+		tr->cap = tr->cap ? 2 * tr->cap : 4096;
+		tr->ops = realloc(tr->ops, tr->cap * sizeof(*tr->ops));
+		if (tr->ops == NULL)
+			err(1, "realloc");
+	}
+	tr->ops[tr->n].type = type;
+	tr->ops[tr->n].space = space;
+	tr->ops[tr->n].vpn = vpn;
+	tr->ops[tr->n].ppn = ppn;
+	tr->n++;
+}
+
+/* map n pages with the given stride from base, then look them up in order */
+static void trace_strided(struct trace *tr, uint64_t base, uint64_t stride, uint64_t n,
+			  uint64_t lookups)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+		trace_add(tr, OP_MAP, 0, (base + i * stride) & VPN_MASK, i);
+	for (i = 0; i < lookups; i++)
+		trace_add(tr, OP_QUERY, 0, (base + i % n * stride) & VPN_MASK, 0);
+}
+
+/* map n random pages, then look them up in random order */
+static void trace_random(struct trace *tr, uint64_t n, uint64_t lookups)
+{
+	uint64_t *vpns = malloc(n * sizeof(*vpns));
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		vpns[i] = rng() & VPN_MASK;
+		trace_add(tr, OP_MAP, 0, vpns[i], i);
+	}
+	for (i = 0; i < lookups; i++)
+		trace_add(tr, OP_QUERY, 0, vpns[rng() % n], 0);
+	free(vpns);
+}
+
+static double zeta(uint64_t n, double theta)
+{
+	double sum = 0;
+	uint64_t i;
+
+	for (i = 1; i <= n; i++)
+		sum += 1 / pow(i, theta);
+	return sum;
+}
+
+/*
+ * Map a working set of random pages and look them up with Zipfian popularity
+ * (the generator of Gray et al., as in YCSB). Every tenth lookup of a popular
+ * page remaps it instead.
+ */
+static void trace_zipf(struct trace *tr, uint64_t n, uint64_t lookups)
+{
+	uint64_t *vpns = malloc(n * sizeof(*vpns));
+	double zetan = zeta(n, ZIPF_THETA);
+	double alpha = 1 / (1 - ZIPF_THETA);
+	double eta = (1 - pow(2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta(2, ZIPF_THETA) / zetan);
+	double u, uz;
+	uint64_t i, rank;
+
+	for (i = 0; i < n; i++) {
+		vpns[i] = rng() & VPN_MASK;
+		trace_add(tr, OP_MAP, 0, vpns[i], i);
+	}
+	for (i = 0; i < lookups; i++) {
+		u = (rng() >> 11) * 0x1.0p-53;
+		uz = u * zetan;
+		if (uz < 1)
+			rank = 0;
+		else if (uz < 1 + pow(0.5, ZIPF_THETA))
+			rank = 1;
+		else
+			rank = n * pow(eta * u - eta + 1, alpha);
+		if (rank >= n)
+			rank = n - 1;
+		if (rank < 16 && i % 10 == 0)
+			trace_add(tr, OP_MAP, 0, vpns[rank], i);
+		else
+			trace_add(tr, OP_QUERY, 0, vpns[rank], 0);
+	}
+	free(vpns);
+}
+
+/*
+ * A parent maps runs of pages, a child gets every mapping the way fork() does,
+ * either by page_table_clone() or by mapping each page again, then both look
+ * pages up while the child remaps some of its pages, as a process that
+ * breaks copy-on-write would.
+ */
+static void trace_fork(struct trace *tr, uint64_t runs, uint64_t run, int clone)
+{
+	uint64_t *bases = malloc(runs * sizeof(*bases));
+	uint64_t i, j, vpn;
+
+	for (i = 0; i < runs; i++) {
+		bases[i] = run_base(i, run);
+		for (j = 0; j < run; j++)
+			trace_add(tr, OP_MAP, 0, bases[i] + j, i * run + j);
+	}
+	if (clone)
+		trace_add(tr, OP_CLONE, 1, 0, 0);
+	for (i = 0; i < runs && !clone; i++) {
+		for (j = 0; j < run; j++)
+			trace_add(tr, OP_MAP, 1, bases[i] + j, i * run + j);
+	}
+	for (i = 0; i < runs * run; i++) {
+		vpn = bases[rng() % runs] + rng() % run;
+		if (i % 8 == 0)
+			trace_add(tr, OP_MAP, 1, vpn, runs * run + i);
+		else
+			trace_add(tr, OP_QUERY, i % 2, vpn, 0);
+	}
+	free(bases);
+}
+
+static void trace_load(struct trace *tr, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	char op;
+	unsigned long long vpn, ppn;
+	int fields, lineno = 0;
+
+	if (f == NULL)
+		err(1, "%s", path);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		fields = sscanf(line, " %c %llx %llx", &op, &vpn, &ppn);
+		/* a line of nothing but whitespace sets no field, not even op */
+		if (fields < 1)
+			continue;
+		if (op == 'm' && fields == 3)
+			trace_add(tr, OP_MAP, 0, vpn, ppn);
+		else if (op == 'u' && fields >= 2)
+			trace_add(tr, OP_UNMAP, 0, vpn, NO_MAPPING);
+		else if (op == 'q' && fields >= 2)
+			trace_add(tr, OP_QUERY, 0, vpn, 0);
+		else
+			errx(1, "%s:%d: bad trace line", path, lineno);
+	}
+	fclose(f);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* percentile p of n sorted samples */
+static uint64_t percentile(const uint64_t *samples, size_t n, int p)
+{
+	return n ? samples[(n - 1) * p / 100] : 0;
+}
+
+static void trace_replay(const struct trace *tr)
+{
+	uint64_t base = frames_in_use();
+	uint64_t pt[2] = { alloc_page_frame(), alloc_page_frame() };
+	uint64_t *query_cycles = malloc(tr->n * sizeof(*query_cycles));
+	uint64_t *update_cycles = malloc(tr->n * sizeof(*update_cycles));
+	uint64_t peak = 0, query_total = 0, frames;
+	size_t nq = 0, nu = 0, i;
+	uint64_t c;
+	double hz = cycles_per_sec();
+	const struct trace_op *op;
+
+	for (i = 0; i < tr->n; i++) {
+		op = &tr->ops[i];
+		if (op->type == OP_QUERY) {
+			c = cycles();
+			page_table_query(pt[op->space], op->vpn);
+			c = cycles() - c;
+			query_cycles[nq++] = c;
+			query_total += c;
+		} else if (op->type == OP_CLONE) {
+			c = cycles();
+			page_table_destroy(pt[1]);
+			pt[1] = page_table_clone(pt[0]);
+			update_cycles[nu++] = cycles() - c;
+		} else {
+			c = cycles();
+			page_table_update(pt[op->space], op->vpn,
+					  op->type == OP_MAP ? op->ppn : NO_MAPPING);
+			update_cycles[nu++] = cycles() - c;
+		}
+		if (i % 1024 == 0 && frames_in_use() - base > peak)
+			peak = frames_in_use() - base;
+	}
+	frames = frames_in_use() - base;
+	if (frames > peak)
+		peak = frames;
+
+	qsort(query_cycles, nq, sizeof(*query_cycles), cmp_u64);
+	qsort(update_cycles, nu, sizeof(*update_cycles), cmp_u64);
+	printf("  %-10s %8zu ops %7.2f Mlookups/s  query p50 %5llu p99 %6llu  update p50 %5llu p99 %6llu cycles"
+	       "  %7llu frames (%.1f MiB, peak %.1f MiB)\n",
+	       tr->name, tr->n, query_total ? nq / (query_total / hz) / 1e6 : 0.0,
+	       (unsigned long long)percentile(query_cycles, nq, 50),
+	       (unsigned long long)percentile(query_cycles, nq, 99),
+	       (unsigned long long)percentile(update_cycles, nu, 50),
+	       (unsigned long long)percentile(update_cycles, nu, 99),
+	       (unsigned long long)frames, frames * 4096.0 / (1 << 20), peak * 4096.0 / (1 << 20));
+
+	page_table_destroy(pt[0]);
+	page_table_destroy(pt[1]);
+	if (frames_in_use() - base != 0)
+		errx(1, "%s: %llu frames left after destroying both tables", tr->name,
+		     (unsigned long long)(frames_in_use() - base));
+	free(update_cycles);
+	free(query_cycles);
+}
+
+static void bench_traces(void)
+{
+	struct trace traces[7] = {
+		{ .name = "sequential" }, { .name = "strided" }, { .name = "random" },
+		{ .name = "zipfian" }, { .name = "fork-copy" }, { .name = "fork-clone" },
+		{ .name = "recorded" },
+	};
+	size_t i, n = 6;
+
+	/* the working sets are kept small enough for NPAGES frames */
+	trace_strided(&traces[0], 0x100000000ULL, 1, TRACE_OPS / 4, TRACE_OPS - TRACE_OPS / 4);
+	/* one page per last level table, plus one to walk off the 2 MiB grid */
+	trace_strided(&traces[1], 0x100000000ULL, 513, TRACE_OPS / 32, TRACE_OPS - TRACE_OPS / 32);
+	trace_random(&traces[2], TRACE_OPS / 32, TRACE_OPS - TRACE_OPS / 32);
+	trace_zipf(&traces[3], TRACE_OPS / 32, TRACE_OPS - TRACE_OPS / 32);
+	trace_fork(&traces[4], 1024, 128, 0);
+	trace_fork(&traces[5], 1024, 128, 1);
+	if (trace_file != NULL) {
+		trace_load(&traces[6], trace_file);
+		traces[6].name = trace_file;
+		n = 7;
+	}
+
+	printf("traces: latencies in TSC cycles at %.2f GHz\n", cycles_per_sec() / 1e9);
+	for (i = 0; i < n; i++) {
+		trace_replay(&traces[i]);
+		free(traces[i].ops);
+	}
+}
+
+/*
+ * The radix trie of pt.c against the hashed page table of pt_hash.c: frames
+ * used and lookup latency with HASH_PAGES pages spread over the whole VPN
+ * space, in runs of HASH_RUN and in one contiguous range.
+ */
+#define HASH_PAGES	(64 * 1024)
+#define HASH_RUN	64
+#define HASH_LOOKUPS	(1024 * 1024)
+
+struct backend {
+	const char *name;
+	void (*update)(uint64_t pt, uint64_t vpn, uint64_t ppn);
+	uint64_t (*query)(uint64_t pt, uint64_t vpn);
+	void (*destroy)(uint64_t pt);
+};
+
+static const struct backend backends[] = {
+	{ "radix", page_table_update, page_table_query, page_table_destroy },
+	{ "hashed", hpt_update, hpt_query, hpt_destroy },
+};
+
+static void bench_hashed_one(const char *layout, const uint64_t *vpns, const uint32_t *order)
+{
+	uint64_t *samples = malloc(HASH_LOOKUPS * sizeof(*samples));
+	uint64_t base, pt, frames, total, c;
+	double hz = cycles_per_sec(), t;
+	size_t b;
+	int i;
+
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+		base = frames_in_use();
+		pt = alloc_page_frame();
+		t = now();
+		for (i = 0; i < HASH_PAGES; i++)
+			backends[b].update(pt, vpns[i], i);
+		t = now() - t;
+		frames = frames_in_use() - base;
+
+		total = 0;
+		for (i = 0; i < HASH_LOOKUPS; i++) {
+			c = cycles();
+			if (backends[b].query(pt, vpns[order[i]]) != order[i])
+				errx(1, "hashed: %s lost a mapping", backends[b].name);
+			samples[i] = cycles() - c;
+			total += samples[i];
+		}
+		qsort(samples, HASH_LOOKUPS, sizeof(*samples), cmp_u64);
+		printf("  %-7s %-6s %6llu frames (%5.1f B/page)  map %6.1f ns/page  %6.2f Mlookups/s  p50 %4llu p99 %5llu cycles\n",
+		       layout, backends[b].name, (unsigned long long)frames, frames * 4096.0 / HASH_PAGES,
+		       t * 1e9 / HASH_PAGES, HASH_LOOKUPS / (total / hz) / 1e6,
+		       (unsigned long long)percentile(samples, HASH_LOOKUPS, 50),
+		       (unsigned long long)percentile(samples, HASH_LOOKUPS, 99));
+
+		backends[b].destroy(pt);
+		if (frames_in_use() != base)
+			errx(1, "hashed: %s kept %lld frames", backends[b].name,
+			     (long long)(frames_in_use() - base));
+	}
+	free(samples);
+}
+
+static void bench_hashed(void)
+{
+	uint64_t *vpns = malloc(HASH_PAGES * sizeof(*vpns));
+	uint32_t *order = malloc(HASH_LOOKUPS * sizeof(*order));
+	int i;
+
+	for (i = 0; i < HASH_LOOKUPS; i++)
+		order[i] = rng() % HASH_PAGES;
+
+	printf("hashed: %d pages, %d random lookups, latencies in TSC cycles\n", HASH_PAGES, HASH_LOOKUPS);
+	for (i = 0; i < HASH_PAGES; i++)
+		vpns[i] = run_base(i, 1);
+	bench_hashed_one("sparse", vpns, order);
+	for (i = 0; i < HASH_PAGES; i++)
+		vpns[i] = run_base(i / HASH_RUN, HASH_RUN) + i % HASH_RUN;
+	bench_hashed_one("runs", vpns, order);
+	for (i = 0; i < HASH_PAGES; i++)
+		vpns[i] = 0x100000000ULL + i;
+	bench_hashed_one("dense", vpns, order);
+
+	free(order);
+	free(vpns);
+}
+
+struct benchmark {
+	const char *name;
+	void (*run)(void);
+};
+
+static const struct benchmark benchmarks[] = {
+	{ "setup", bench_setup },
+	{ "tlb", bench_tlb },
+	{ "psc", bench_psc },
+	{ "batch", bench_batch },
+	{ "huge", bench_huge },
+	{ "snapshot", bench_snapshot },
+	{ "scan", bench_scan },
+	{ "simd", bench_simd },
+	{ "churn", bench_churn },
+	{ "fork", bench_fork },
+	{ "threads", bench_threads },
+	{ "traces", bench_traces },
+	{ "hashed", bench_hashed },
+};
+
+#define NBENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	int j;
+
+	mtx_init(&frame_lock, mtx_plain);
+
+	if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+		trace_file = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc == 1) {
+		for (i = 0; i < NBENCHMARKS; i++)
+			benchmarks[i].run();
+		return 0;
+	}
+
+	for (j = 1; j < argc; j++) {
+		for (i = 0; i < NBENCHMARKS; i++) {
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				break;
+		}
+		if (i == NBENCHMARKS)
+			errx(1, "unknown benchmark: %s", argv[j]);
+		benchmarks[i].run();
+	}
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+#include "os.h"
+#include <stdlib.h>
+
+// A hashed page table: instead of a trie with a table per level, one open-addressing
+// hash table maps clusters of CLUSTER_PAGES consecutive VPNs to their PTEs, so a
+// lone mapping costs a slot instead of a frame per level, and a lookup touches the
+// root, one directory frame and one bucket frame whatever the size of the address
+// space. Slots are probed linearly and deleted by shifting the rest of their probe
+// chain back, so there are no tombstones. Every frame comes from alloc_page_frame(),
+// the table doubles once it is 3/4 full and halves once it is 1/8 full.
+//
+// Unlike pt.c it does not support huge leaves or concurrent updates: one thread at a
+// time may update a page table, and no thread may query it meanwhile. Build with
+// -DPT_HASHED to link it in place of pt.c behind page_table_update() and
+// page_table_query().
+
+#define CLUSTER_BITS 3
+#define CLUSTER_PAGES (1 << CLUSTER_BITS)
+#define BUCKET_SLOTS 56         // as many clusters as fit one frame with their tags
+#define DIR_ENTRIES 512
+#define ROOT_DIRS 510
+#define HPT_VALID 0x1ULL
+
+// The root frame of a page table. A zeroed frame is an empty page table.
+typedef struct HptRoot {
+    uint64_t buckets;           // bucket frames, 0 until the first mapping
+    uint64_t used;              // slots in use
+    uint64_t dirs[ROOT_DIRS];   // directory frames, DIR_ENTRIES bucket frames each
+} HptRoot;
+
+// A bucket frame: the tags first so a probe scans them a cache line at a time, then
+// one cache line of PTEs per slot. A tag is the VPN's cluster plus one, 0 when free.
+typedef struct HptBucket {
+    uint64_t tags[BUCKET_SLOTS];
+    uint64_t ptes[BUCKET_SLOTS][CLUSTER_PAGES];
+} HptBucket;
+
+_Static_assert(sizeof(HptRoot) <= 4096 && sizeof(HptBucket) <= 4096, "must fit one frame");
+
+// a helper function to get the root of the page table pt
+static HptRoot* hptRoot(uint64_t pt){
+    return (HptRoot *)phys_to_virt(pt << 12);
+}
+
+// a helper function to get the bucket frame that holds slot
+static HptBucket* hptBucket(HptRoot* root, uint64_t slot){
+    uint64_t bucket = slot / BUCKET_SLOTS;
+    uint64_t* dir = (uint64_t *)phys_to_virt(root->dirs[bucket / DIR_ENTRIES] << 12);
+    return (HptBucket *)phys_to_virt(dir[bucket % DIR_ENTRIES] << 12);
+}
+
+// a helper function to get the slot a cluster hashes to, spread over all slots
+static uint64_t hptHome(uint64_t tag, uint64_t slots){
+    return (uint64_t)(((unsigned __int128)(tag * 0x9E3779B97F4A7C15ULL) * slots) >> 64);
+}
+
+// a helper function to find the slot of tag, or the free slot that ends its probe
+// chain. Returns the slot's bucket and leaves the slot in *slot.
+static HptBucket* hptFind(HptRoot* root, uint64_t tag, uint64_t* slot){
+    uint64_t slots = root->buckets * BUCKET_SLOTS;
+    uint64_t i = hptHome(tag, slots);
+    HptBucket* bucket = hptBucket(root, i);
+    for(;;){
+        if(bucket->tags[i % BUCKET_SLOTS] == tag || bucket->tags[i % BUCKET_SLOTS] == 0){
+            *slot = i;
+            return bucket;
+        }
+        if(++i == slots){
+            i = 0;
+        }
+        if(i % BUCKET_SLOTS == 0){
+            bucket = hptBucket(root, i);
+        }
+    }
+}
+
+// a helper function to give all bucket and directory frames of root back
+static void hptFreeFrames(HptRoot* root){
+    uint64_t* dir;
+    uint64_t i;
+    for(i = 0; i < root->buckets; i++){
+        dir = (uint64_t *)phys_to_virt(root->dirs[i / DIR_ENTRIES] << 12);
+        free_page_frame(dir[i % DIR_ENTRIES]);
+    }
+    for(i = 0; i * DIR_ENTRIES < root->buckets; i++){
+        free_page_frame(root->dirs[i]);
+    }
+}
+
+// a helper function to move every cluster into a table of the given number of bucket
+// frames, freeing the old ones
+static void hptResize(HptRoot* root, uint64_t buckets){
+    HptRoot old = *root;
+    HptBucket* from;
+    HptBucket* to;
+    uint64_t* dir = NULL;
+    uint64_t i, k, slot;
+    if(buckets > (uint64_t)ROOT_DIRS * DIR_ENTRIES){
+        abort();
+    }
+    for(i = 0; i < buckets; i++){
+        if(i % DIR_ENTRIES == 0){
+            root->dirs[i / DIR_ENTRIES] = alloc_page_frame();
+            dir = (uint64_t *)phys_to_virt(root->dirs[i / DIR_ENTRIES] << 12);
+        }
+        dir[i % DIR_ENTRIES] = alloc_page_frame();
+    }
+    root->buckets = buckets;
+    for(i = 0; i < old.buckets * BUCKET_SLOTS; i++){
+        from = hptBucket(&old, i);
+        if(from->tags[i % BUCKET_SLOTS] == 0){
+            continue;
+        }
+        to = hptFind(root, from->tags[i % BUCKET_SLOTS], &slot);
+        to->tags[slot % BUCKET_SLOTS] = from->tags[i % BUCKET_SLOTS];
+        for(k = 0; k < CLUSTER_PAGES; k++){
+            to->ptes[slot % BUCKET_SLOTS][k] = from->ptes[i % BUCKET_SLOTS][k];
+        }
+    }
+    hptFreeFrames(&old);
+}
+
+// a helper function to free slot, moving back the clusters after it that would no
+// longer be found past the hole
+static void hptRemove(HptRoot* root, uint64_t slot){
+    uint64_t slots = root->buckets * BUCKET_SLOTS;
+    uint64_t hole = slot;
+    uint64_t i = slot;
+    uint64_t home, k;
+    HptBucket* from;
+    HptBucket* to = hptBucket(root, hole);
+    for(;;){
+        if(++i == slots){
+            i = 0;
+        }
+        from = hptBucket(root, i);
+        if(from->tags[i % BUCKET_SLOTS] == 0){
+            break;
+        }
+        home = hptHome(from->tags[i % BUCKET_SLOTS], slots);
+        // leave it unless its home lies cyclically in (hole, i]
+        if((i + slots - home) % slots < (i + slots - hole) % slots){
+            continue;
+        }
+        to->tags[hole % BUCKET_SLOTS] = from->tags[i % BUCKET_SLOTS];
+        for(k = 0; k < CLUSTER_PAGES; k++){
+            to->ptes[hole % BUCKET_SLOTS][k] = from->ptes[i % BUCKET_SLOTS][k];
+        }
+        hole = i;
+        to = from;
+    }
+    to->tags[hole % BUCKET_SLOTS] = 0;
+    for(k = 0; k < CLUSTER_PAGES; k++){
+        to->ptes[hole % BUCKET_SLOTS][k] = 0;
+    }
+    root->used--;
+}
+
+// Function to update the hashed page table. Unmapping the last page of a cluster
+// frees its slot.
+void hpt_update(uint64_t pt, uint64_t vpn, uint64_t ppn){
+    HptRoot* root = hptRoot(pt);
+    HptBucket* bucket;
+    uint64_t tag = (vpn >> CLUSTER_BITS) + 1;
+    uint64_t slot;
+    uint64_t* ptes;
+    uint64_t k;
+    if(root->buckets == 0){
+        if(ppn == NO_MAPPING){
+            return;
+        }
+        hptResize(root, 1);
+    }
+    bucket = hptFind(root, tag, &slot);
+    if(bucket->tags[slot % BUCKET_SLOTS] == 0){
+        if(ppn == NO_MAPPING){
+            return;
+        }
+        if(4 * (root->used + 1) > 3 * root->buckets * BUCKET_SLOTS){
+            hptResize(root, 2 * root->buckets);
+            bucket = hptFind(root, tag, &slot);
+        }
+        bucket->tags[slot % BUCKET_SLOTS] = tag;
+        root->used++;
+    }
+    ptes = bucket->ptes[slot % BUCKET_SLOTS];
+    if(ppn != NO_MAPPING){
+        ptes[vpn % CLUSTER_PAGES] = (ppn << 12) | HPT_VALID;
+        return;
+    }
+    ptes[vpn % CLUSTER_PAGES] = 0;
+    for(k = 0; k < CLUSTER_PAGES; k++){
+        if(ptes[k] & HPT_VALID){
+            return;
+        }
+    }
+    hptRemove(root, slot);
+    if(root->used == 0){
+        hptFreeFrames(root);
+        root->buckets = 0;
+    }
+    else if(root->buckets > 1 && 8 * root->used < root->buckets * BUCKET_SLOTS){
+        hptResize(root, root->buckets / 2);
+    }
+}
+
+// Function to query the hashed page table
+uint64_t hpt_query(uint64_t pt, uint64_t vpn){
+    HptRoot* root = hptRoot(pt);
+    HptBucket* bucket;
+    uint64_t slot;
+    uint64_t pte;
+    if(root->buckets == 0){
+        return NO_MAPPING;
+    }
+    bucket = hptFind(root, (vpn >> CLUSTER_BITS) + 1, &slot);
+    pte = bucket->ptes[slot % BUCKET_SLOTS][vpn % CLUSTER_PAGES];
+    return (pte & HPT_VALID) ? pte >> 12 : NO_MAPPING;
+}
+
+// Function to free every frame of the hashed page table pt, its root included
+void hpt_destroy(uint64_t pt){
+    hptFreeFrames(hptRoot(pt));
+    free_page_frame(pt);
+}
+
+#ifdef PT_HASHED
+void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn){
+    hpt_update(pt, vpn, ppn);
+}
+
+uint64_t page_table_query(uint64_t pt, uint64_t vpn){
+    return hpt_query(pt, vpn);
+}
+#endif
@@ -1,46 +1,404 @@
 
 #include "queue.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdatomic.h>
 #include <threads.h>
 
+#define CACHE_MAX 64    // free Nodes a thread keeps before handing them to the queue
+#define STATS_BUCKETS 40    // histogram bucket i counts times of 2^i to 2^(i+1) - 1 ns
+
+// the histograms of the stats kept with -DQUEUE_STATS are the QUEUE_STAT_* before it
+#define STAT_HISTOGRAMS QUEUE_STAT_WAKEUPS
+
 // ================================== data structures ==================================//
 // Node structure
 typedef struct Node {
     void* data;
     struct Node* next;
     struct Node* prev;
+#ifdef QUEUE_STATS
+    uint64_t stamp;     // when it was enqueued
+#endif
 } Node;
 // ThreadNode structure
 typedef struct ThreadNode {
     cnd_t cond;
+    mtx_t mutex;        // a waiting dequeue sleeps on cond with this one, not the queue's
+    bool signaled;      // set once an item is handed to the thread, or a slot kept for it
+    bool stop;          // set when the queue is shut down under a sleeping dequeue
+    void** out;         // where a sleeping dequeue wants its items, at most max
+    size_t max;
+    size_t count;       // how many were handed to it
+#ifdef QUEUE_STATS
+    uint64_t handed_at; // when its items were handed to it
+#endif
     struct ThreadNode* next;
     struct ThreadNode* prev;
 } ThreadNode;
-// Queue structure
-typedef struct Queue {
+// Lane structure, the free items of one priority level, newest at head
+typedef struct Lane {
     Node* head;
     Node* tail;
-    int total_visited;
     int size;
-    mtx_t mutex;
-
-} Queue;
+} Lane;
 // Thread_queue structure
 typedef struct Thread_queue {
     ThreadNode* head;
     ThreadNode* tail;
     int waiting_threads;
+    ThreadNode* next_wake;  // oldest thread not signaled, the ones before it all are
+    int signaled;
 } Thread_queue;
+// Queue structure, behind a queue_t handle. Each priority level keeps its items in a
+// lane of its own, except that a bounded queue keeps the ones of level 0 in ring,
+// oldest at first. No item waits in either while a thread waits for one, enqueues
+// hand their items straight to the waiting threads.
+typedef struct Queue {
+    Lane lanes[QUEUE_PRIORITIES];
+    int total_visited;
+    int size;           // of all the lanes
+    mtx_t mutex;
+    Thread_queue threads;
+    void** ring;
+    size_t capacity;    // 0 when unbounded
+    size_t first;
+    Thread_queue producers;     // threads waiting for room
+    Node* free_nodes;   // batches of Nodes that threads' caches overflowed with,
+                        // linked through the prev of their first Node
+    bool shutdown;
+    cnd_t drained;      // signaled when the last thread woken by the shutdown leaves
+#ifdef QUEUE_STATS
+    uint64_t* stamps;   // when the items of ring were enqueued
+#endif
+} Queue;
+#ifdef QUEUE_STATS
+// Histogram structure, of times in ns
+typedef struct Histogram {
+    atomic_uint_fast64_t buckets[STATS_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total;
+    atomic_uint_fast64_t max;
+} Histogram;
+// Stats structure, one per thread. Only its thread writes it, queueStatsDump() adds
+// them up.
+typedef struct Stats {
+    Histogram histograms[STAT_HISTOGRAMS];
+    atomic_uint_fast64_t max_waiting;       // dequeues waiting in one queue
+    atomic_uint_fast64_t max_producers;     // enqueues waiting in one queue for room
+    atomic_uint_fast64_t wakeups;           // returns from waiting on a condition variable
+    uint64_t locked_at;                     // when the thread took the mutex it holds
+} Stats;
+#endif
+// ThreadCache structure, one per thread: the ThreadNode it waits on, whose condition
+// variable lives as long as the thread, the Nodes it freed last and the ones it took
+// from the queue's free list
+typedef struct ThreadCache {
+    ThreadNode waiter;
+    Node* free_head;
+    int free_count;
+    Node* spare;
+#ifdef QUEUE_STATS
+    struct ThreadCache* next;   // in the list of the running threads
+    struct ThreadCache* prev;
+    _Alignas(64) Stats stats;   // on cache lines of its own
+#endif
+} ThreadCache;
 
 // ================================== global variables ==================================//
-Queue* queue;
-Thread_queue* threads;
+static Queue* default_queue;  // the queue of the functions without a handle
+static tss_t cache_key;
+static once_flag cache_once = ONCE_FLAG_INIT;
+static thread_local ThreadCache* cache;
+#ifdef QUEUE_STATS
+static mtx_t stats_mutex;
+static ThreadCache* stats_threads;  // the running threads that used a queue
+static Stats retired_stats;         // added up from the threads that finished
+#endif
 
 // ================================= helper functions =================================
 
-// a helper function to add a thread to the thread queue
-void addThread(ThreadNode* thread){
+// a helper function to free a list of Nodes
+static void freeNodes(Node* node){
+    Node* next;
+    while (node != NULL){
+        next = node->next;
+        free(node);
+        node = next;
+    }
+}
+
+#ifdef QUEUE_STATS
+// a helper function to add the stats of from to into
+static void addStats(Stats* into, Stats* from){
+    Histogram* to;
+    Histogram* histogram;
+    uint64_t value;
+    for (int i = 0; i < STAT_HISTOGRAMS; i++){
+        to = &into->histograms[i];
+        histogram = &from->histograms[i];
+        for (int j = 0; j < STATS_BUCKETS; j++){
+            to->buckets[j] += atomic_load_explicit(&histogram->buckets[j], memory_order_relaxed);
+        }
+        to->count += atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        to->total += atomic_load_explicit(&histogram->total, memory_order_relaxed);
+        value = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+        if (value > to->max){
+            to->max = value;
+        }
+    }
+    value = atomic_load_explicit(&from->max_waiting, memory_order_relaxed);
+    if (value > into->max_waiting){
+        into->max_waiting = value;
+    }
+    value = atomic_load_explicit(&from->max_producers, memory_order_relaxed);
+    if (value > into->max_producers){
+        into->max_producers = value;
+    }
+    into->wakeups += atomic_load_explicit(&from->wakeups, memory_order_relaxed);
+}
+#endif
+
+// a helper function to free a finished thread's cache
+static void freeCache(void* arg){
+    ThreadCache* thread_cache = arg;
+#ifdef QUEUE_STATS
+    mtx_lock(&stats_mutex);
+    addStats(&retired_stats, &thread_cache->stats);
+    if (thread_cache->prev == NULL){
+        stats_threads = thread_cache->next;
+    }
+    else{
+        thread_cache->prev->next = thread_cache->next;
+    }
+    if (thread_cache->next != NULL){
+        thread_cache->next->prev = thread_cache->prev;
+    }
+    mtx_unlock(&stats_mutex);
+#endif
+    freeNodes(thread_cache->free_head);
+    freeNodes(thread_cache->spare);
+    cnd_destroy(&thread_cache->waiter.cond);
+    mtx_destroy(&thread_cache->waiter.mutex);
+    free(thread_cache);
+}
+
+// a helper function to create the key of freeCache()
+static void makeCacheKey(void){
+    tss_create(&cache_key, freeCache);
+#ifdef QUEUE_STATS
+    mtx_init(&stats_mutex, mtx_plain);
+#endif
+}
+
+// a helper function to get the calling thread's cache
+static ThreadCache* threadCache(void){
+    if (cache == NULL){
+        call_once(&cache_once, makeCacheKey);
+        cache = aligned_alloc(_Alignof(ThreadCache), sizeof(ThreadCache));
+        cnd_init(&cache->waiter.cond);
+        mtx_init(&cache->waiter.mutex, mtx_plain);
+        cache->free_head = NULL;
+        cache->free_count = 0;
+        cache->spare = NULL;
+#ifdef QUEUE_STATS
+        memset(&cache->stats, 0, sizeof(Stats));
+        mtx_lock(&stats_mutex);
+        cache->prev = NULL;
+        cache->next = stats_threads;
+        if (stats_threads != NULL){
+            stats_threads->prev = cache;
+        }
+        stats_threads = cache;
+        mtx_unlock(&stats_mutex);
+#endif
+        tss_set(cache_key, cache);
+    }
+    return cache;
+}
+
+#ifdef QUEUE_STATS
+// a helper function to read the clock in ns
+static uint64_t statsNow(void){
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// a helper function to add to a counter of the calling thread's stats, which no other
+// thread writes
+static void bump(atomic_uint_fast64_t* counter, uint64_t by){
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + by,
+                          memory_order_relaxed);
+}
+
+// a helper function to raise a maximum of the calling thread's stats to value
+static void raiseTo(atomic_uint_fast64_t* maximum, uint64_t value){
+    if (value > atomic_load_explicit(maximum, memory_order_relaxed)){
+        atomic_store_explicit(maximum, value, memory_order_relaxed);
+    }
+}
+
+// a helper function to count n times of ns in the calling thread's histogram
+static void statsAdd(int which, uint64_t ns, size_t n){
+    Histogram* histogram = &threadCache()->stats.histograms[which];
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && ns >> (bucket + 1) != 0){
+        bucket++;
+    }
+    bump(&histogram->buckets[bucket], n);
+    bump(&histogram->count, n);
+    bump(&histogram->total, ns * n);
+    raiseTo(&histogram->max, ns);
+}
+
+// a helper function to count n times of the time since start, in the calling thread's
+// histogram. Returns the time it took as now.
+static uint64_t statsRecord(int which, uint64_t start, size_t n){
+    uint64_t now = statsNow();
+    statsAdd(which, now > start ? now - start : 0, n);
+    return now;
+}
+
+// a helper function to count n operations that took the time since start together,
+// each with its share of it
+static void statsRecordShared(int which, uint64_t start, size_t n){
+    uint64_t now = statsNow();
+    statsAdd(which, now > start ? (now - start) / n : 0, n);
+}
+
+// a helper function to count the time taken to lock the queue's mutex since start
+static void statsLocked(uint64_t start){
+    threadCache()->stats.locked_at = statsRecord(QUEUE_STAT_LOCK_WAIT, start, 1);
+}
+
+// a helper function to count the time the queue's mutex was held, before unlocking it
+static void statsUnlocking(void){
+    statsRecord(QUEUE_STAT_LOCK_HOLD, threadCache()->stats.locked_at, 1);
+}
+
+// a helper function to count a return from waiting on a condition variable
+static void statsWoken(void){
+    bump(&threadCache()->stats.wakeups, 1);
+}
+
+// a helper function to count a return from waiting on a condition variable with the
+// queue's mutex, which is held from now on
+static void statsRelocked(void){
+    statsWoken();
+    threadCache()->stats.locked_at = statsNow();
+}
+
+// a helper function to count how many threads wait, for items or for room
+static void statsWaiting(Thread_queue* threads, bool producers){
+    Stats* stats = &threadCache()->stats;
+    raiseTo(producers ? &stats->max_producers : &stats->max_waiting, threads->waiting_threads);
+}
+
+// a helper function to find the time under which percent of a histogram's times are,
+// rounded up to its bucket's end
+static uint64_t percentile(Histogram* histogram, int percent){
+    uint64_t rank = (histogram->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    uint64_t end;
+    for (int i = 0; i < STATS_BUCKETS && rank > 0; i++){
+        seen += histogram->buckets[i];
+        if (seen >= rank){
+            end = ((uint64_t)2 << i) - 1;
+            return end < histogram->max ? end : histogram->max;
+        }
+    }
+    return 0;
+}
+#else
+static inline uint64_t statsNow(void){ return 0; }
+static inline uint64_t statsRecord(int which, uint64_t start, size_t n){
+    (void)which; (void)start; (void)n;
+    return 0;
+}
+static inline void statsRecordShared(int which, uint64_t start, size_t n){
+    (void)which; (void)start; (void)n;
+}
+static inline void statsLocked(uint64_t start){ (void)start; }
+static inline void statsUnlocking(void){}
+static inline void statsWoken(void){}
+static inline void statsRelocked(void){}
+static inline void statsWaiting(Thread_queue* threads, bool producers){
+    (void)threads; (void)producers;
+}
+#endif
+
+// a helper function to lock the queue's mutex
+static void lockQueue(Queue* queue){
+    uint64_t start = statsNow();
+    mtx_lock(&queue->mutex);
+    statsLocked(start);
+}
+
+// a helper function to unlock the queue's mutex
+static void unlockQueue(Queue* queue){
+    statsUnlocking();
+    mtx_unlock(&queue->mutex);
+}
+
+// a helper function to wait on cond, with the queue's mutex held, until deadline (NULL
+// for none) passes
+static int waitQueue(Queue* queue, cnd_t* cond, const struct timespec* deadline){
+    int result;
+    statsUnlocking();
+    if (deadline == NULL){
+        result = cnd_wait(cond, &queue->mutex);
+    }
+    else{
+        result = cnd_timedwait(cond, &queue->mutex, deadline);
+    }
+    statsRelocked();
+    return result;
+}
+
+// a helper function to get a Node from the thread's cache, taking a batch of the
+// queue's free Nodes when it is empty. Called with the mutex held.
+Node* newNode(Queue* queue){
+    ThreadCache* thread_cache = threadCache();
+    Node* node = thread_cache->free_head;
+    if (node != NULL){
+        thread_cache->free_head = node->next;
+        thread_cache->free_count--;
+        return node;
+    }
+    if (thread_cache->spare == NULL && queue->free_nodes != NULL){
+        thread_cache->spare = queue->free_nodes;
+        queue->free_nodes = queue->free_nodes->prev;
+    }
+    node = thread_cache->spare;
+    if (node == NULL){
+        return malloc(sizeof(Node));
+    }
+    thread_cache->spare = node->next;
+    return node;
+}
+
+// a helper function to put a Node in the thread's cache, handing the cache to the
+// queue as one batch once it holds more than CACHE_MAX. Called with the mutex held.
+void freeNode(Queue* queue, Node* node){
+    ThreadCache* thread_cache = threadCache();
+    node->next = thread_cache->free_head;
+    thread_cache->free_head = node;
+    if (++thread_cache->free_count > CACHE_MAX){
+        thread_cache->free_head->prev = queue->free_nodes;
+        queue->free_nodes = thread_cache->free_head;
+        thread_cache->free_head = NULL;
+        thread_cache->free_count = 0;
+    }
+}
+
+// a helper function to add a thread to a thread queue
+void addThread(Thread_queue* threads, ThreadNode* thread){
+    thread->signaled = false;
+    thread->stop = false;
+    thread->next = NULL;
+    thread->prev = NULL;
     if (threads->head == NULL){
         threads->head = thread;
         threads->tail = thread;
@@ -50,190 +408,669 @@ void addThread(ThreadNode* thread){
         threads->head->prev = thread;
         threads->head = thread;
     }
+    if (threads->next_wake == NULL){
+        threads->next_wake = thread;
+    }
     threads->waiting_threads++;
 }
 
-// a helper function to remove the tail of the thread queue
-void removeThreadTail(void){
-    if (threads->waiting_threads == 1){
-        cnd_destroy(&threads->tail->cond);
-        free(threads->tail);
-        threads->tail = NULL;
-        threads->head = NULL;
-        threads->waiting_threads--;
+// a helper function to remove a thread from anywhere in a thread queue, for the
+// threads woken together that may run in any order and the ones that time out. The
+// node belongs to its thread's cache and is kept for its next wait.
+void removeThread(Thread_queue* threads, ThreadNode* thread){
+    if (thread->signaled){
+        threads->signaled--;
+    }
+    else if (thread == threads->next_wake){
+        // the threads after it were not signaled either
+        threads->next_wake = thread->prev;
     }
-    else if (threads->waiting_threads > 1){
-        ThreadNode* temp = threads->tail->prev;
-        cnd_destroy(&threads->tail->cond);
-        free(threads->tail);
-        threads->tail = temp;
-        threads->tail->next = NULL;
-        threads->waiting_threads--;
+    if (thread->prev == NULL){
+        threads->head = thread->next;
+    }
+    else{
+        thread->prev->next = thread->next;
     }
+    if (thread->next == NULL){
+        threads->tail = thread->prev;
+    }
+    else{
+        thread->next->prev = thread->prev;
+    }
+    threads->waiting_threads--;
 }
 
-// a helper function to add a node to the queue
-void addNode(Node* node){
-    if (queue->head == NULL){
-        queue->head = node;
-        queue->tail = node;
+// a helper function to signal the oldest thread of a thread queue that was not
+// signaled yet
+void signalNext(Thread_queue* threads){
+    ThreadNode* thread = threads->next_wake;
+    thread->signaled = true;
+    cnd_signal(&thread->cond);
+    threads->signaled++;
+    threads->next_wake = thread->prev;
+}
+
+// a helper function to unlink the oldest Node of a lane
+Node* unlinkTail(Lane* lane){
+    Node* node = lane->tail;
+    lane->tail = node->prev;
+    if (lane->tail == NULL){
+        lane->head = NULL;
     }
     else{
-        node->next = queue->head;
-        queue->head->prev = node;
-        queue->head = node;
-    }
-    queue->size++;
-}
-
-// a helper function to remove the tail of the queue
-void removeQueueTail(void){
-    if (queue->size == 1){
-        free(queue->tail);
-        queue->tail = NULL;
-        queue->head = NULL;
-        queue->size--;
-        queue->total_visited++;
-    }
-    else if (queue->size > 1){
-        Node* temp = queue->tail->prev;
-        free(queue->tail);
-        queue->tail = temp;
-        queue->tail->next = NULL;
-        queue->size--;
-        queue->total_visited++;
+        lane->tail->next = NULL;
+    }
+    return node;
+}
+
+// a helper function to remove the oldest item of the highest lane that has one and
+// return it. The caller counts it out of the queue's size.
+void* popFree(Queue* queue){
+    Lane* lane = &queue->lanes[QUEUE_PRIORITIES - 1];
+    void* item;
+    Node* node;
+    while (lane->size == 0){
+        lane--;
+    }
+    lane->size--;
+    if (lane == queue->lanes && queue->ring != NULL){
+        item = queue->ring[queue->first];
+#ifdef QUEUE_STATS
+        statsRecord(QUEUE_STAT_ITEM, queue->stamps[queue->first], 1);
+#endif
+        queue->first = (queue->first + 1) % queue->capacity;
+        return item;
+    }
+    node = unlinkTail(lane);
+    item = node->data;
+#ifdef QUEUE_STATS
+    statsRecord(QUEUE_STAT_ITEM, node->stamp, 1);
+#endif
+    freeNode(queue, node);
+    return item;
+}
+
+// a helper function to add a chain of n nodes, linked from newest to oldest, to a
+// lane of the queue
+void addChain(Queue* queue, Lane* lane, Node* newest, Node* oldest, size_t n){
+    if (lane->head == NULL){
+        lane->tail = oldest;
     }
     else{
+        oldest->next = lane->head;
+        lane->head->prev = oldest;
+    }
+    lane->head = newest;
+    lane->size += n;
+    queue->size += n;
+}
+
+// a helper function to add n items to the lane of level, oldest first. A bounded queue
+// must have room for them.
+void putItems(Queue* queue, int level, void** items, size_t n){
+    Lane* lane = &queue->lanes[level];
+    Node* newest = NULL;
+    Node* oldest = NULL;
+    Node* new_node;
+#ifdef QUEUE_STATS
+    uint64_t now = statsNow();
+#endif
+    if (level == 0 && queue->ring != NULL){
+        for (size_t i = 0; i < n; i++){
+#ifdef QUEUE_STATS
+            queue->stamps[(queue->first + lane->size) % queue->capacity] = now;
+#endif
+            queue->ring[(queue->first + lane->size) % queue->capacity] = items[i];
+            lane->size++;
+            queue->size++;
+        }
         return;
     }
+    // link the items into a chain first, then add it at once
+    for (size_t i = 0; i < n; i++){
+        new_node = newNode(queue);
+        new_node->data = items[i];
+#ifdef QUEUE_STATS
+        new_node->stamp = now;
+#endif
+        new_node->next = newest;
+        new_node->prev = NULL;
+        if (newest != NULL){
+            newest->prev = new_node;
+        }
+        else{
+            oldest = new_node;
+        }
+        newest = new_node;
+    }
+    addChain(queue, lane, newest, oldest, n);
 }
 
-// a helper function to remove a node from the queue
-void removeNode(Node* node){
-    if (node->prev == NULL){
-        queue->head = node->next;
-        queue->head->prev = NULL;
+// a helper function to take up to max items, oldest first. Returns how many it took.
+size_t takeItems(Queue* queue, void** out, size_t max){
+    size_t count = (size_t)queue->size < max ? (size_t)queue->size : max;
+    for (size_t i = 0; i < count; i++){
+        out[i] = popFree(queue);
     }
-    else if (node->next == NULL){
-        queue->tail = node->prev;
-        queue->tail->next = NULL;
+    queue->size -= count;
+    queue->total_visited += count;
+    return count;
+}
+
+// a helper function to tell if a bounded queue has a free slot that no thread waiting
+// for room was woken for
+bool hasRoom(Queue* queue){
+    return (size_t)queue->size + queue->producers.signaled < queue->capacity;
+}
+
+// a helper function to wake the oldest threads waiting for room, one per free slot. A
+// woken thread keeps its slot until it runs.
+void wakeProducers(Queue* queue){
+    while (queue->producers.next_wake != NULL && hasRoom(queue)){
+        signalNext(&queue->producers);
     }
-    else{
-        node->prev->next = node->next;
-        node->next->prev = node->prev;
+}
+
+// a helper function to hand up to n items, oldest first, straight to the oldest waiting
+// thread and wake it, taking it off the thread queue. Returns how many it took, 0 if no
+// thread waits.
+size_t handOff(Queue* queue, void** items, size_t n){
+    ThreadNode* thread = queue->threads.tail;
+    size_t count;
+    if (thread == NULL){
+        return 0;
+    }
+    count = n < thread->max ? n : thread->max;
+    removeThread(&queue->threads, thread);
+    mtx_lock(&thread->mutex);
+    for (size_t i = 0; i < count; i++){
+        thread->out[i] = items[i];
+    }
+    thread->count = count;
+#ifdef QUEUE_STATS
+    thread->handed_at = statsNow();
+#endif
+    thread->signaled = true;
+    cnd_signal(&thread->cond);
+    mtx_unlock(&thread->mutex);
+    queue->total_visited += count;
+    return count;
+}
+
+// a helper function to sleep until a thread waiting for room is signaled, the queue is
+// shut down or deadline (NULL for none) passes, then take the thread off threads
+void waitSignaled(Queue* queue, Thread_queue* threads, ThreadNode* thread,
+                  const struct timespec* deadline){
+    int result = thrd_success;
+    while (!thread->signaled && !queue->shutdown && result != thrd_timedout){
+        result = waitQueue(queue, &thread->cond, deadline);
+    }
+    removeThread(threads, thread);
+    // let queue_destroy() go on once every thread woken by the shutdown is gone
+    if (queue->shutdown && queue->threads.waiting_threads == 0 &&
+        queue->producers.waiting_threads == 0){
+        cnd_signal(&queue->drained);
+    }
+}
+
+// a helper function to wait until a bounded queue has room for one more item, behind
+// the threads already waiting for room. Returns false if deadline (NULL for none)
+// passed or the queue was shut down first.
+bool waitForRoom(Queue* queue, const struct timespec* deadline){
+    Thread_queue* producers = &queue->producers;
+    ThreadNode* thread;
+    // every thread still waiting was woken with a slot of its own
+    if (producers->next_wake == NULL && hasRoom(queue)){
+        return true;
+    }
+    thread = &threadCache()->waiter;
+    addThread(producers, thread);
+    statsWaiting(producers, true);
+    waitSignaled(queue, producers, thread, deadline);
+    return thread->signaled && !queue->shutdown;
+}
+
+// a helper function to add item at level once there is room for it and wake the oldest
+// waiting thread. Returns false if deadline passed first or the queue is shut down.
+bool putItem(Queue* queue, int level, void* item, const struct timespec* deadline){
+    if (queue->shutdown){
+        return false;
+    }
+    if (queue->ring != NULL && !waitForRoom(queue, deadline)){
+        return false;
+    }
+    if (handOff(queue, &item, 1) == 0){
+        putItems(queue, level, &item, 1);
     }
-    free(node);
-    queue->size--;
-    queue->total_visited++;
+    else if (queue->ring != NULL){
+        // the slot this thread may have been woken for is still free
+        wakeProducers(queue);
+    }
+    return true;
+}
+
+// a helper function to take up to max items, waiting behind the threads already waiting
+// if there are none. Called with the mutex held, returns with it released, and is out
+// of it while the thread sleeps, so the items handed over need no lock to return.
+// Returns how many it took, 0 if deadline (NULL for none) passed or the queue was shut
+// down first, then with QUEUE_SHUTDOWN in out[0] for the latter.
+size_t waitForItems(Queue* queue, void** out, size_t max, const struct timespec* deadline){
+    Thread_queue* threads = &queue->threads;
+    ThreadNode* thread;
+    int result = thrd_success;
+    size_t count;
+    bool signaled;
+    if (threads->waiting_threads == 0 && queue->size > 0){
+        count = takeItems(queue, out, max);
+        wakeProducers(queue);
+        unlockQueue(queue);
+        return count;
+    }
+    if (queue->shutdown){
+        // the threads still waiting are on their way out, don't queue behind them
+        unlockQueue(queue);
+        out[0] = QUEUE_SHUTDOWN;
+        return 0;
+    }
+    // queue this thread's node and sleep until items are handed to it
+    thread = &threadCache()->waiter;
+    addThread(threads, thread);
+    statsWaiting(threads, false);
+    thread->out = out;
+    thread->max = max;
+    mtx_lock(&thread->mutex);
+    unlockQueue(queue);
+    while (!thread->signaled && !thread->stop && result != thrd_timedout){
+        if (deadline == NULL){
+            cnd_wait(&thread->cond, &thread->mutex);
+        }
+        else{
+            result = cnd_timedwait(&thread->cond, &thread->mutex, deadline);
+        }
+        statsWoken();
+    }
+    // handOff() writes it under this mutex or the queue's, so read it under one of them
+    signaled = thread->signaled;
+    mtx_unlock(&thread->mutex);
+    if (!signaled){
+        // an enqueue may still hand it items until it is off the thread queue
+        lockQueue(queue);
+        if (!thread->signaled){
+            removeThread(threads, thread);
+            // let queue_destroy() go on once every thread woken by the shutdown is gone
+            if (queue->shutdown && threads->waiting_threads == 0 &&
+                queue->producers.waiting_threads == 0){
+                cnd_signal(&queue->drained);
+            }
+            if (queue->shutdown){
+                out[0] = QUEUE_SHUTDOWN;
+            }
+            unlockQueue(queue);
+            return 0;
+        }
+        unlockQueue(queue);
+    }
+#ifdef QUEUE_STATS
+    statsRecord(QUEUE_STAT_ITEM, thread->handed_at, thread->count);
+#endif
+    return thread->count;
 }
 // ================================== initialization ==================================
-void initQueue(void) {
+queue_t* queue_create(void) {
     // Initialize the queue
-    queue = malloc(sizeof(Queue));
-    threads = malloc(sizeof(Thread_queue));
-    queue->head = NULL;
-    queue->tail = NULL;
-    threads->head = NULL;
-    threads->tail = NULL;
-    threads->waiting_threads = 0;
+    Queue* queue = malloc(sizeof(Queue));
+    for (int i = 0; i < QUEUE_PRIORITIES; i++){
+        queue->lanes[i].head = NULL;
+        queue->lanes[i].tail = NULL;
+        queue->lanes[i].size = 0;
+    }
+    queue->threads.head = NULL;
+    queue->threads.tail = NULL;
+    queue->threads.waiting_threads = 0;
+    queue->threads.next_wake = NULL;
+    queue->threads.signaled = 0;
     queue->size = 0;
     queue->total_visited = 0;
+    queue->free_nodes = NULL;
+    queue->ring = NULL;
+    queue->capacity = 0;
+    queue->first = 0;
+    queue->producers.head = NULL;
+    queue->producers.tail = NULL;
+    queue->producers.waiting_threads = 0;
+    queue->producers.next_wake = NULL;
+    queue->producers.signaled = 0;
+    queue->shutdown = false;
+#ifdef QUEUE_STATS
+    queue->stamps = NULL;
+#endif
     mtx_init(&queue->mutex, mtx_plain);
+    cnd_init(&queue->drained);
+    return queue;
+}
+
+queue_t* queue_createBounded(size_t capacity) {
+    Queue* queue = queue_create();
+    if (capacity > 0){
+        queue->ring = malloc(capacity * sizeof(void*));
+        queue->capacity = capacity;
+#ifdef QUEUE_STATS
+        queue->stamps = malloc(capacity * sizeof(uint64_t));
+#endif
+    }
+    return queue;
+}
+
+void initQueue(void) {
+    default_queue = queue_create();
+}
+
+void initBoundedQueue(size_t capacity) {
+    default_queue = queue_createBounded(capacity);
 }
 
 // ================================== destruction ==================================
-void destroyQueue(void){
+void queue_shutdown(queue_t* queue){
+    ThreadNode* thread;
+    lockQueue(queue);
+    queue->shutdown = true;
+    // the threads leave the thread queues themselves once they run
+    for (thread = queue->threads.head; thread != NULL; thread = thread->next){
+        mtx_lock(&thread->mutex);
+        thread->stop = true;
+        cnd_signal(&thread->cond);
+        mtx_unlock(&thread->mutex);
+    }
+    for (thread = queue->producers.head; thread != NULL; thread = thread->next){
+        cnd_signal(&thread->cond);
+    }
+    unlockQueue(queue);
+}
+
+void queueShutdown(void){
+    queue_shutdown(default_queue);
+}
+
+void queue_destroy(queue_t* queue){
     // Destroy the queue
     if (queue == NULL){
         return;
     }
-    mtx_lock(&queue->mutex);
-    while (queue->size > 0){
-        removeQueueTail();
+    queue_shutdown(queue);
+    lockQueue(queue);
+    // wait for the woken threads to leave before their queue goes away
+    while (queue->threads.waiting_threads > 0 || queue->producers.waiting_threads > 0){
+        waitQueue(queue, &queue->drained, NULL);
     }
-    while (threads->waiting_threads > 0){
-        removeThreadTail();
+    for (int i = 0; i < QUEUE_PRIORITIES; i++){
+        freeNodes(queue->lanes[i].head);
     }
-    mtx_unlock(&queue->mutex);
+    free(queue->ring);
+#ifdef QUEUE_STATS
+    free(queue->stamps);
+#endif
+    while (queue->free_nodes != NULL){
+        Node* batch = queue->free_nodes;
+        queue->free_nodes = batch->prev;
+        freeNodes(batch);
+    }
+    unlockQueue(queue);
     mtx_destroy(&queue->mutex);
-   
+    cnd_destroy(&queue->drained);
+    free(queue);
+}
+
+void destroyQueue(void){
+    queue_destroy(default_queue);
+    default_queue = NULL;
 }
 // ================================== queue operations ==================================
-void enqueue(void* item){
-    mtx_lock(&queue->mutex);
-    Node* new_node = malloc(sizeof(Node));
-    new_node->data = item;
-    addNode(new_node);
-    // wake up the thread that is in tail and let him dequeue the item
-    if (threads->waiting_threads > 0 && queue->size > 0){
-        cnd_signal(&threads->tail->cond);
-    }
-    mtx_unlock(&queue->mutex);
+void queue_enqueue(queue_t* queue, void* item){
+    uint64_t start = statsNow();
+    lockQueue(queue);
+    putItem(queue, 0, item, NULL);
+    unlockQueue(queue);
+    statsRecord(QUEUE_STAT_ENQUEUE, start, 1);
     return;
 }
 
-void* dequeue(void) {
-    mtx_lock(&queue->mutex);
+void queue_enqueuePriority(queue_t* queue, void* item, int level){
+    if (level < 0){
+        level = 0;
+    }
+    else if (level >= QUEUE_PRIORITIES){
+        level = QUEUE_PRIORITIES - 1;
+    }
+    uint64_t start = statsNow();
+    lockQueue(queue);
+    putItem(queue, level, item, NULL);
+    unlockQueue(queue);
+    statsRecord(QUEUE_STAT_ENQUEUE, start, 1);
+}
+
+bool queue_tryEnqueue(queue_t* queue, void* item){
+    uint64_t start = statsNow();
+    bool room;
+    lockQueue(queue);
+    // the free slots are kept for the threads waiting for room
+    room = queue->ring == NULL || (queue->producers.next_wake == NULL && hasRoom(queue));
+    room = room && putItem(queue, 0, item, NULL);
+    unlockQueue(queue);
+    statsRecord(QUEUE_STAT_ENQUEUE, start, 1);
+    return room;
+}
+
+bool queue_enqueueTimed(queue_t* queue, void* item, const struct timespec* deadline){
+    uint64_t start = statsNow();
+    bool added;
+    lockQueue(queue);
+    added = putItem(queue, 0, item, deadline);
+    unlockQueue(queue);
+    statsRecord(QUEUE_STAT_ENQUEUE, start, 1);
+    return added;
+}
+
+void queue_enqueueBatch(queue_t* queue, void** items, size_t n){
+    uint64_t start = statsNow();
+    size_t count = n;
+    size_t handed;
+    if (n == 0){
+        return;
+    }
+    lockQueue(queue);
+    if (queue->ring == NULL){
+        if (!queue->shutdown){
+            // the oldest items go to the waiting threads, the rest to the queue
+            while (n > 0 && (handed = handOff(queue, items, n)) > 0){
+                items += handed;
+                n -= handed;
+            }
+            if (n > 0){
+                putItems(queue, 0, items, n);
+            }
+        }
+    }
+    else{
+        // a bounded queue takes them one by one, as room frees up
+        for (size_t i = 0; i < n && putItem(queue, 0, items[i], NULL); i++){
+        }
+    }
+    unlockQueue(queue);
+    statsRecordShared(QUEUE_STAT_ENQUEUE, start, count);
+}
+
+void* queue_dequeue(queue_t* queue) {
     void* item;
-    if(threads -> waiting_threads > 0 || queue -> size == 0){
-        // create a new thread and wait for it to dequeue the item
-        ThreadNode* new_thread = malloc(sizeof(ThreadNode));
-        cnd_init(&new_thread->cond);
-        addThread(new_thread);
-        cnd_wait(&new_thread->cond, &queue->mutex);   
-    }
-    item = queue->tail->data;
-    removeQueueTail();
-    removeThreadTail();
-    // wake up the thread that is in tail and let him dequeue the item
-    if (threads->waiting_threads > 0 && queue->size > 0){
-        cnd_signal(&threads->tail->cond);
+    if (queue_dequeueBatch(queue, &item, 1) == 0){
+        return QUEUE_SHUTDOWN;
     }
-    mtx_unlock(&queue->mutex);
     return item;
-} 
+}
 
-bool tryDequeue(void** item) {
-    mtx_lock(&queue->mutex);
-    // if there are more waiting threads than the size of the queue, return false
-    if(threads->waiting_threads >= queue->size){  
-        mtx_unlock(&queue->mutex);
+bool queue_dequeueTimed(queue_t* queue, void** item, const struct timespec* deadline){
+    uint64_t start = statsNow();
+    void* first = NULL;
+    bool taken;
+    lockQueue(queue);
+    taken = waitForItems(queue, &first, 1, deadline) > 0 || first == QUEUE_SHUTDOWN;
+    statsRecord(QUEUE_STAT_DEQUEUE, start, 1);
+    if (!taken){
         return false;
     }
-    else if (threads->waiting_threads == 0){
-        *item = queue -> tail -> data;
-        removeQueueTail();
-    }
-    // if there are waiting threads, bypass the waiting threads and dequeue the item
-    else{
-        Node* temp = queue->tail;
-        for (int i = 0; i < threads->waiting_threads; i++){
-        temp = temp->prev;
-        }   
-        *item = temp->data;
-        removeNode(temp);
-    }
-    
-    mtx_unlock(&queue->mutex);
+    *item = first;
     return true;
-    
+}
+
+size_t queue_dequeueBatch(queue_t* queue, void** out, size_t max) {
+    uint64_t start = statsNow();
+    size_t count;
+    if (max == 0){
+        return 0;
+    }
+    lockQueue(queue);
+    count = waitForItems(queue, out, max, NULL);
+    statsRecord(QUEUE_STAT_DEQUEUE, start, 1);
+    return count;
+} 
+
+bool queue_tryDequeue(queue_t* queue, void** item) {
+    return queue_tryDequeueBatch(queue, item, 1) == 1;
+}
+
+size_t queue_tryDequeueBatch(queue_t* queue, void** out, size_t max) {
+    uint64_t start = statsNow();
+    lockQueue(queue);
+    size_t count = takeItems(queue, out, max);
+    wakeProducers(queue);
+    unlockQueue(queue);
+    statsRecord(QUEUE_STAT_TRY_DEQUEUE, start, 1);
+    return count;
+}
+
+void enqueue(void* item){
+    queue_enqueue(default_queue, item);
+}
+
+void enqueuePriority(void* item, int level){
+    queue_enqueuePriority(default_queue, item, level);
+}
+
+bool tryEnqueue(void* item){
+    return queue_tryEnqueue(default_queue, item);
+}
+
+bool enqueueTimed(void* item, const struct timespec* deadline){
+    return queue_enqueueTimed(default_queue, item, deadline);
+}
+
+void enqueueBatch(void** items, size_t n){
+    queue_enqueueBatch(default_queue, items, n);
+}
+
+void* dequeue(void) {
+    return queue_dequeue(default_queue);
+}
+
+bool dequeueTimed(void** item, const struct timespec* deadline) {
+    return queue_dequeueTimed(default_queue, item, deadline);
+}
+
+size_t dequeueBatch(void** out, size_t max) {
+    return queue_dequeueBatch(default_queue, out, max);
+}
+
+bool tryDequeue(void** item) {
+    return queue_tryDequeue(default_queue, item);
+}
+
+size_t tryDequeueBatch(void** out, size_t max) {
+    return queue_tryDequeueBatch(default_queue, out, max);
 }
 // ================================== queue information ==================================//
-size_t size(void) {
-    mtx_lock(&queue->mutex);
+size_t queue_size(queue_t* queue) {
+    lockQueue(queue);
     size_t size = queue->size;
-    mtx_unlock(&queue->mutex);
+    unlockQueue(queue);
     return size;
 }
 
-size_t waiting(void) {
-    mtx_lock(&queue->mutex);
-    size_t waiting = threads->waiting_threads;
-    mtx_unlock(&queue->mutex);
+size_t queue_waiting(queue_t* queue) {
+    lockQueue(queue);
+    size_t waiting = queue->threads.waiting_threads;
+    unlockQueue(queue);
     return waiting;
 }
 
-size_t visited(void) {
+size_t queue_visited(queue_t* queue) {
     // no locks
     return queue->total_visited;
 }
+
+size_t size(void) {
+    return queue_size(default_queue);
+}
+
+size_t waiting(void) {
+    return queue_waiting(default_queue);
+}
+
+size_t visited(void) {
+    return queue_visited(default_queue);
+}
+
+#ifdef QUEUE_STATS
+// a helper function to add up the stats of every thread, finished or running
+static void totalStats(Stats* total){
+    ThreadCache* thread_cache;
+    call_once(&cache_once, makeCacheKey);
+    memset(total, 0, sizeof(Stats));
+    mtx_lock(&stats_mutex);
+    addStats(total, &retired_stats);
+    for (thread_cache = stats_threads; thread_cache != NULL; thread_cache = thread_cache->next){
+        addStats(total, &thread_cache->stats);
+    }
+    mtx_unlock(&stats_mutex);
+}
+#endif
+
+uint64_t queueStatsCount(int stat){
+#ifdef QUEUE_STATS
+    Stats total;
+    totalStats(&total);
+    if (stat == QUEUE_STAT_WAKEUPS){
+        return total.wakeups;
+    }
+    return stat >= 0 && stat < STAT_HISTOGRAMS ? total.histograms[stat].count : 0;
+#else
+    (void)stat;
+    return 0;
+#endif
+}
+
+void queueStatsDump(void){
+#ifdef QUEUE_STATS
+    static const char* names[STAT_HISTOGRAMS] = {
+        "lock wait", "lock hold", "enqueue", "dequeue", "tryDequeue", "in queue"};
+    Stats total;
+    Histogram* histogram;
+    uint64_t items;
+    totalStats(&total);
+    printf("%-12s %12s %10s %10s %10s %10s    ns\n", "", "count", "mean", "p50", "p99", "max");
+    for (int i = 0; i < STAT_HISTOGRAMS; i++){
+        histogram = &total.histograms[i];
+        printf("%-12s %12llu %10.0f %10llu %10llu %10llu\n", names[i],
+               (unsigned long long)histogram->count,
+               histogram->count > 0 ? (double)histogram->total / histogram->count : 0.0,
+               (unsigned long long)percentile(histogram, 50),
+               (unsigned long long)percentile(histogram, 99),
+               (unsigned long long)histogram->max);
+    }
+    items = total.histograms[QUEUE_STAT_ITEM].count;
+    printf("most threads waiting in a queue: %llu dequeues, %llu enqueues\n",
+           (unsigned long long)total.max_waiting, (unsigned long long)total.max_producers);
+    printf("wakeups: %llu, %.2f per item\n", (unsigned long long)total.wakeups,
+           items > 0 ? (double)total.wakeups / items : 0.0);
+#else
+    printf("queue stats are off, build queue.c with -DQUEUE_STATS\n");
+#endif
+}
@@ -1,11 +1,81 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
+/* Implemented by queue.c and by queue_lockfree.c, link one of them. The lock-free one
+ * serves up to 1024 threads at a time: a thread beyond them blocks in its first call
+ * until one of them exits. */
 void initQueue(void);
 void destroyQueue(void);
 void enqueue(void*);
 void* dequeue(void);
 bool tryDequeue(void**);
+/* Batched variants that take the lock once. The dequeues return how many items they
+ * stored in out, oldest first; dequeueBatch() blocks until there is at least one. */
+void enqueueBatch(void** items, size_t n);
+size_t dequeueBatch(void** out, size_t max);
+size_t tryDequeueBatch(void** out, size_t max);
+/* A bounded queue holds at most capacity items in a ring allocated up front. Its
+ * enqueue() blocks while it is full, waking in the order the threads came. tryEnqueue()
+ * fails instead, and enqueueTimed() once the TIME_UTC deadline passes; on a queue
+ * without capacity they always succeed. */
+void initBoundedQueue(size_t capacity);
+bool tryEnqueue(void* item);
+bool enqueueTimed(void* item, const struct timespec* deadline);
+/* dequeueTimed() gives up once the TIME_UTC deadline passes, returning false.
+ * queueShutdown() wakes every waiting thread: from then on the dequeues return
+ * QUEUE_SHUTDOWN (dequeueTimed() true with it in *item, the batches 0) once the items
+ * left are gone, and the enqueues drop their items (tryEnqueue() and enqueueTimed()
+ * return false). destroyQueue() shuts the queue down and waits for the woken threads
+ * to leave it. */
+#define QUEUE_SHUTDOWN ((void*)-1)
+bool dequeueTimed(void** item, const struct timespec* deadline);
+void queueShutdown(void);
+/* Priority lanes: enqueuePriority() adds item at level 0, the one of the other
+ * enqueues, up to QUEUE_PRIORITIES - 1, clamping the levels out of range. The
+ * dequeues take the oldest item of the highest level that has one, and the threads
+ * waiting for items are still served in the order they came. */
+#define QUEUE_PRIORITIES 4
+void enqueuePriority(void* item, int level);
 size_t size(void);
 size_t waiting(void);
 size_t visited(void);
+/* queueStatsDump() prints the stats that queue.c keeps when built with -DQUEUE_STATS,
+ * added up over every queue and thread: how long the mutexes were waited for and held,
+ * how long the enqueues, dequeues and tryDequeues took and the items spent in the
+ * queue, the most threads that waited in one queue and how often waiting threads woke
+ * per item. */
+void queueStatsDump(void);
+/* queueStatsCount() returns the samples one of those histograms counted so far, or the
+ * wakeups: one per lock taken and per lock held, per item enqueued, per dequeue and
+ * tryDequeue call (batches included) and per item dequeued. Always 0 without the
+ * stats. */
+#define QUEUE_STAT_LOCK_WAIT 0
+#define QUEUE_STAT_LOCK_HOLD 1
+#define QUEUE_STAT_ENQUEUE 2
+#define QUEUE_STAT_DEQUEUE 3
+#define QUEUE_STAT_TRY_DEQUEUE 4
+#define QUEUE_STAT_ITEM 5
+#define QUEUE_STAT_WAKEUPS 6
+uint64_t queueStatsCount(int stat);
+
+/* Independent queues, each with its own lock and waiting threads. The functions above
+ * work on a default queue that initQueue() creates and destroyQueue() destroys. */
+typedef struct Queue queue_t;
+queue_t* queue_create(void);
+queue_t* queue_createBounded(size_t capacity);
+void queue_destroy(queue_t* q);
+void queue_shutdown(queue_t* q);
+void queue_enqueue(queue_t* q, void* item);
+void queue_enqueuePriority(queue_t* q, void* item, int level);
+void* queue_dequeue(queue_t* q);
+bool queue_tryDequeue(queue_t* q, void** item);
+bool queue_dequeueTimed(queue_t* q, void** item, const struct timespec* deadline);
+bool queue_tryEnqueue(queue_t* q, void* item);
+bool queue_enqueueTimed(queue_t* q, void* item, const struct timespec* deadline);
+void queue_enqueueBatch(queue_t* q, void** items, size_t n);
+size_t queue_dequeueBatch(queue_t* q, void** out, size_t max);
+size_t queue_tryDequeueBatch(queue_t* q, void** out, size_t max);
+size_t queue_size(queue_t* q);
+size_t queue_waiting(queue_t* q);
+size_t queue_visited(queue_t* q);
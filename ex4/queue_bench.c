@@ -0,0 +1,344 @@
+// Queue benchmarks.
+//
+//     gcc -O2 -std=c11 -pthread -o queue_bench queue_bench.c queue.c queue_sharded.c
+//     ./queue_bench [benchmark...]
+//
+// Link queue_lockfree.c instead of queue.c to measure the lock-free queue. With no
+// benchmarks named every benchmark is run.
+//
+// sleepers: the cost of an enqueue and a tryDequeue while 0 to 1000 threads that
+// were woken for an item have not run yet. The process is pinned to one CPU and the
+// sleepers run at SCHED_IDLE, so they only take their items once the timing is done.
+//
+// wakeup: the time from an enqueue to the return of the dequeue that slept for it,
+// with 1 to 8 threads sleeping on the queue, one item at a time or one for each.
+//
+// scaling: enqueue and dequeue pairs per microsecond from 1 thread up to one on each
+// CPU, all on one queue, for the FIFO queue and the sharded one.
+//
+// priority: the time from an enqueue to its dequeue for items at level 0 and at the
+// highest level, each enqueued behind BACKLOG items of level 0 for one worker thread.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "queue.h"
+#include "queue_sharded.h"
+
+#define PAIRS 200000    // enqueue and tryDequeue pairs per round
+#define ROUNDS 5
+#define WAKEUPS 20000   // items the wakeup benchmark times
+#define SCALING 1000000 // enqueue and dequeue pairs the scaling benchmark times
+#define CONTROLS 2000   // items the priority benchmark times
+#define BACKLOG 1000    // and the flood items it keeps in the queue meanwhile
+
+// ================================= helper functions =================================
+
+// a helper function to read a monotonic clock in nanoseconds
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// a helper function to sleep for ms milliseconds
+static void sleepMs(long ms){
+    thrd_sleep(&(struct timespec){.tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000}, NULL);
+}
+
+// a helper function to compare two doubles for qsort()
+static int compareDoubles(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// a sleeper thread, dequeues until the queue is shut down
+static int sleeper(void* arg){
+    queue_t* queue = arg;
+    sched_setscheduler(0, SCHED_IDLE, &(struct sched_param){0});
+    while (queue_dequeue(queue) != QUEUE_SHUTDOWN){
+    }
+    return 0;
+}
+
+// ================================== benchmarks ==================================
+
+static queue_t* ping;       // items for the wakeup benchmark's sleepers
+static queue_t* pong;       // and their answers
+static double stamps[WAKEUPS];
+static double latencies[WAKEUPS];
+
+// a wakeup thread, times each item from its enqueue to the return of its dequeue and
+// answers it
+static int wakeup(void* arg){
+    void* item;
+    (void)arg;
+    while ((item = queue_dequeue(ping)) != QUEUE_SHUTDOWN){
+        long i = (long)item;
+        latencies[i] = now() - stamps[i];
+        queue_enqueue(pong, item);
+    }
+    return 0;
+}
+
+// a helper function to time WAKEUPS items, enqueued burst at a time once n threads
+// sleep on the queue, and print the median and 99th percentile in microseconds
+static void benchWakeup(int n, int burst){
+    thrd_t* threads = malloc(n * sizeof(thrd_t));
+    void* items[burst];
+    ping = queue_create();
+    pong = queue_create();
+    for (int i = 0; i < n; i++){
+        thrd_create(&threads[i], wakeup, NULL);
+    }
+    for (long i = 0; i + burst <= WAKEUPS; i += burst){
+        while (queue_waiting(ping) < (size_t)n){
+            thrd_yield();
+        }
+        for (int j = 0; j < burst; j++){
+            items[j] = (void*)(i + j);
+            stamps[i + j] = now();
+        }
+        queue_enqueueBatch(ping, items, burst);
+        for (int j = 0; j < burst; j++){
+            queue_dequeue(pong);
+        }
+    }
+    // only the threads sleeping in it are woken, the others would find it gone
+    while (queue_waiting(ping) < (size_t)n){
+        thrd_yield();
+    }
+    queue_destroy(ping);
+    for (int i = 0; i < n; i++){
+        thrd_join(threads[i], NULL);
+    }
+    queue_destroy(pong);
+    free(threads);
+    qsort(latencies, WAKEUPS, sizeof(double), compareDoubles);
+    printf("%8d  %8d  %8.2f  %8.2f\n", n, burst, latencies[WAKEUPS / 2] / 1000,
+           latencies[WAKEUPS * 99 / 100] / 1000);
+}
+
+// a helper function to time PAIRS enqueue and tryDequeue pairs with n woken sleepers
+// that hold on to the queue's items. Returns the best round in ns per pair.
+static double benchSleepers(int n){
+    queue_t* queue = queue_create();
+    thrd_t* threads = malloc(n * sizeof(thrd_t));
+    void** items = malloc(n * sizeof(void*));
+    double best = 0;
+    void* item;
+    for (int i = 0; i < n; i++){
+        thrd_create(&threads[i], sleeper, queue);
+        items[i] = (void*)(long)(i + 1);
+    }
+    for (int round = 0; round < ROUNDS; round++){
+        // wait for the sleepers to take the last round's items and sleep again
+        while (queue_waiting(queue) < (size_t)n || queue_size(queue) > 0){
+            sleepMs(1);
+        }
+        // wake them all, with an item kept for each
+        queue_enqueueBatch(queue, items, n);
+        double start = now();
+        for (int i = 0; i < PAIRS; i++){
+            queue_enqueue(queue, (void*)(long)i);
+            // a sleeper that got to run takes the odd item, miss it
+            queue_tryDequeue(queue, &item);
+        }
+        double ns = (now() - start) / PAIRS;
+        if (round == 0 || ns < best){
+            best = ns;
+        }
+    }
+    // only the threads sleeping in it are woken, the others would find it gone
+    while (queue_waiting(queue) < (size_t)n){
+        sleepMs(1);
+    }
+    queue_destroy(queue);
+    for (int i = 0; i < n; i++){
+        thrd_join(threads[i], NULL);
+    }
+    free(threads);
+    free(items);
+    return best;
+}
+
+// a helper function to run the sleepers benchmark
+static void runSleepers(void){
+    static const int counts[] = {0, 1, 10, 100, 1000};
+    cpu_set_t all, one;
+    sched_getaffinity(0, sizeof(all), &all);
+    CPU_ZERO(&one);
+    CPU_SET(sched_getcpu(), &one);
+    sched_setaffinity(0, sizeof(one), &one);
+    printf("sleepers  ns per enqueue + tryDequeue\n");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++){
+        printf("%8d  %8.1f\n", counts[i], benchSleepers(counts[i]));
+    }
+    sched_setaffinity(0, sizeof(all), &all);
+}
+
+// a helper function to run the wakeup benchmark
+static void runWakeup(void){
+    static const int counts[] = {1, 2, 8};
+    printf("sleepers  items     p50 us    p99 us    from enqueue to dequeue return\n");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++){
+        benchWakeup(counts[i], 1);
+    }
+    for (size_t i = 1; i < sizeof(counts) / sizeof(counts[0]); i++){
+        benchWakeup(counts[i], counts[i]);
+    }
+}
+
+static atomic_bool go;      // starts the scaling benchmark's threads together
+static int pairs;           // that each of them runs
+
+// a scaling thread on the FIFO queue
+static int fifoPairs(void* arg){
+    queue_t* queue = arg;
+    while (!atomic_load(&go)){
+    }
+    for (int i = 0; i < pairs; i++){
+        queue_enqueue(queue, (void*)(long)(i + 1));
+        queue_dequeue(queue);
+    }
+    return 0;
+}
+
+// a scaling thread on the sharded queue
+static int shardedPairs(void* arg){
+    sharded_t* queue = arg;
+    while (!atomic_load(&go)){
+    }
+    for (int i = 0; i < pairs; i++){
+        sharded_enqueue(queue, (void*)(long)(i + 1));
+        sharded_dequeue(queue);
+    }
+    return 0;
+}
+
+// a helper function to time SCALING pairs split over n threads running pair on queue.
+// Returns pairs per microsecond.
+static double benchScaling(int n, thrd_start_t pair, void* queue){
+    thrd_t* threads = malloc(n * sizeof(thrd_t));
+    double start;
+    pairs = SCALING / n;
+    atomic_store(&go, false);
+    for (int i = 0; i < n; i++){
+        thrd_create(&threads[i], pair, queue);
+    }
+    start = now();
+    atomic_store(&go, true);
+    for (int i = 0; i < n; i++){
+        thrd_join(threads[i], NULL);
+    }
+    free(threads);
+    return pairs * n * 1000.0 / (now() - start);
+}
+
+// a helper function to run the scaling benchmark
+static void runScaling(void){
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    queue_t* fifo;
+    sharded_t* sharded;
+    printf("threads      fifo   sharded    pairs per us\n");
+    for (int n = 1; ; n = n * 2 < cpus ? n * 2 : cpus){
+        fifo = queue_create();
+        sharded = sharded_create();
+        printf("%7d  %8.2f  %8.2f\n", n, benchScaling(n, fifoPairs, fifo),
+               benchScaling(n, shardedPairs, sharded));
+        queue_destroy(fifo);
+        sharded_destroy(sharded);
+        if (n == cpus){
+            break;
+        }
+    }
+}
+
+static queue_t* bulk;               // the priority benchmark's queue
+static atomic_int controls_done;
+
+// a worker thread, dequeues until the queue is shut down and times the timed items,
+// 1 to CONTROLS
+static int worker(void* arg){
+    void* item;
+    (void)arg;
+    while ((item = queue_dequeue(bulk)) != QUEUE_SHUTDOWN){
+        long i = (long)item - 1;
+        if (i < CONTROLS){
+            latencies[i] = now() - stamps[i];
+            atomic_fetch_add(&controls_done, 1);
+        }
+    }
+    return 0;
+}
+
+// a helper function to time CONTROLS items enqueued one at a time at level, each
+// behind a backlog topped up to BACKLOG items, and print the median and 99th
+// percentile in microseconds
+static void benchPriority(int level){
+    void** backlog = malloc(BACKLOG * sizeof(void*));
+    size_t size;
+    thrd_t consumer;
+    bulk = queue_create();
+    atomic_store(&controls_done, 0);
+    for (int i = 0; i < BACKLOG; i++){
+        backlog[i] = (void*)(long)(CONTROLS + 1);
+    }
+    thrd_create(&consumer, worker, NULL);
+    for (long i = 0; i < CONTROLS; i++){
+        // the worker woken by the first items may take them all before the stamp
+        while ((size = queue_size(bulk)) < BACKLOG){
+            queue_enqueueBatch(bulk, backlog, BACKLOG - size);
+        }
+        stamps[i] = now();
+        queue_enqueuePriority(bulk, (void*)(i + 1), level);
+        while (atomic_load(&controls_done) <= i){
+            thrd_yield();
+        }
+    }
+    free(backlog);
+    queue_shutdown(bulk);
+    thrd_join(consumer, NULL);
+    queue_destroy(bulk);
+    qsort(latencies, CONTROLS, sizeof(double), compareDoubles);
+    printf("%5d  %8.2f  %8.2f\n", level, latencies[CONTROLS / 2] / 1000,
+           latencies[CONTROLS * 99 / 100] / 1000);
+}
+
+// a helper function to run the priority benchmark
+static void runPriority(void){
+    printf("level    p50 us    p99 us    behind %d items of level 0\n", BACKLOG);
+    benchPriority(0);
+    benchPriority(QUEUE_PRIORITIES - 1);
+}
+
+static const struct {
+    const char* name;
+    void (*run)(void);
+} benchmarks[] = {
+    {"sleepers", runSleepers},
+    {"wakeup", runWakeup},
+    {"scaling", runScaling},
+    {"priority", runPriority},
+};
+
+int main(int argc, char** argv){
+    size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    for (size_t i = 0; i < count; i++){
+        bool run = argc == 1;
+        for (int j = 1; j < argc; j++){
+            run = run || strcmp(argv[j], benchmarks[i].name) == 0;
+        }
+        if (run){
+            benchmarks[i].run();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,826 @@
+#include "queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+// A lock-free implementation of queue.h, linked instead of queue.c.
+//
+// Every enqueue and dequeue takes a ticket with one fetch-and-add on the tail or head
+// counter, and the n-th enqueue meets the n-th dequeue in slot n. The slots live in a
+// list of segments that are allocated as the tickets reach them and freed once both
+// counters are past them and no thread announces one of them in its hazard slot.
+// A dequeue whose slot is still empty spins for a while and then parks on its
+// thread's condition variable until the matching enqueue hands the item over, so the
+// sleepers are served in the order they called dequeue(), like in queue.c, and a lock
+// is only taken when the queue was empty. tryDequeue() only takes a ticket whose item
+// is there, so it never waits for, or takes an item promised to, a sleeper. A sleeper
+// that times out abandons its slot, and the enqueue that reaches it takes a new ticket.
+//
+// A bounded queue keeps one permit per free slot in a second queue: enqueues take a
+// permit first, so they block in the order they came while it is full, and dequeues
+// put the permits back.
+//
+// The priority levels above 0 each keep their items in a queue of their own, created
+// on first use, that the dequeues look in first, highest level first. A priority item
+// goes to the queue itself when a dequeue sleeps in it. A dequeue that took its ticket
+// looks in the lanes once more and abandons the ticket for an item there, and a
+// priority enqueue that finds a sleeper after adding its item moves one over, so no
+// item is left in a lane while a thread sleeps.
+//
+// Shutting a queue down enqueues a QUEUE_SHUTDOWN sentinel for every sleeper, and a
+// dequeue that took its ticket too late for them abandons its slot instead of sleeping.
+// The dequeues that may sleep announce the queue in their thread's hazard slot, and
+// queue_destroy() waits for the sleepers it woke to take their announcements back.
+//
+// There are hazard slots for MAX_THREADS threads. A thread that finds them all taken
+// waits in its first call for a thread that used the queues to exit.
+
+#define SEGMENT_SLOTS 1024
+#define MAX_THREADS 1024        // threads using queues at the same time
+#define SPIN_COUNT 128          // checks of an empty slot before parking
+
+#define SLOT_EMPTY 0            // otherwise the Parker of the dequeue waiting on it
+#define SLOT_FULL 1
+#define SLOT_ABANDONED 2
+#define PERMIT ((void*)1)
+
+// ================================== data structures ==================================//
+// Parker structure, one per thread, to sleep on until an enqueue fills our slot
+typedef struct Parker {
+    mtx_t mutex;
+    cnd_t cond;
+    bool ready;
+} Parker;
+// Slot structure
+typedef struct Slot {
+    void* data;
+    atomic_uintptr_t state;
+} Slot;
+// Segment structure
+typedef struct Segment {
+    uint64_t id;                // holds tickets id * SEGMENT_SLOTS and up
+    _Atomic(struct Segment*) next;
+    Slot slots[SEGMENT_SLOTS];
+} Segment;
+// Queue structure, behind a queue_t handle, the counters on cache lines of their own
+typedef struct Queue {
+    _Alignas(64) atomic_uint_fast64_t head;         // next dequeue ticket
+    _Alignas(64) atomic_uint_fast64_t tail;         // next enqueue ticket
+    _Alignas(64) _Atomic(Segment*) head_segment;    // no later than head's segment
+    _Atomic(Segment*) tail_segment;                 // no later than tail's segment
+    atomic_size_t total_visited;
+    atomic_int_fast64_t abandoned;                  // abandoned slots past tail
+    _Alignas(64) atomic_flag reclaiming;
+    Segment* first;                                 // oldest segment not freed yet
+    struct Queue* room;                             // permits of a bounded queue
+    _Atomic(struct Queue*) lanes[QUEUE_PRIORITIES - 1];     // of the levels above 0
+    atomic_bool shutdown;
+} Queue;
+// Hazard structure: the segment a thread may be using, and all that follow it, and the
+// queue it may sleep in
+typedef struct Hazard {
+    _Alignas(64) _Atomic(Segment*) segment;
+    _Atomic(Queue*) queue;
+    atomic_bool used;
+} Hazard;
+// ThreadState structure
+typedef struct ThreadState {
+    Hazard* hazard;
+    Parker parker;
+} ThreadState;
+
+// ================================== global variables ==================================//
+static Queue* default_queue;    // the queue of the functions without a handle
+static Hazard hazards[MAX_THREADS];
+static atomic_int hazards_used;     // slots claimed so far, reclaim() scans that many
+static tss_t thread_key;
+static once_flag thread_once = ONCE_FLAG_INIT;
+static thread_local ThreadState* self;
+
+// ================================= helper functions =================================
+
+// a helper function to give a finished thread's hazard slot back
+static void threadExit(void* arg){
+    ThreadState* state = arg;
+    atomic_store(&state->hazard->segment, NULL);
+    atomic_store(&state->hazard->queue, NULL);
+    atomic_store(&state->hazard->used, false);
+    mtx_destroy(&state->parker.mutex);
+    cnd_destroy(&state->parker.cond);
+    free(state);
+}
+
+// a helper function to create the key of threadExit()
+static void makeThreadKey(void){
+    tss_create(&thread_key, threadExit);
+}
+
+// a helper function to get the calling thread's hazard slot and parker, waiting for
+// one to be given back if every slot is taken
+static ThreadState* threadState(void){
+    int i = MAX_THREADS, used;
+    if (self != NULL){
+        return self;
+    }
+    call_once(&thread_once, makeThreadKey);
+    self = malloc(sizeof(ThreadState));
+    mtx_init(&self->parker.mutex, mtx_plain);
+    cnd_init(&self->parker.cond);
+    self->parker.ready = false;
+    while (i == MAX_THREADS){
+        for (i = 0; i < MAX_THREADS; i++){
+            bool expected = false;
+            if (atomic_compare_exchange_strong(&hazards[i].used, &expected, true)){
+                break;
+            }
+        }
+        if (i == MAX_THREADS){
+            thrd_yield();
+        }
+    }
+    self->hazard = &hazards[i];
+    used = atomic_load(&hazards_used);
+    while (used <= i && !atomic_compare_exchange_weak(&hazards_used, &used, i + 1)){
+    }
+    tss_set(thread_key, self);
+    return self;
+}
+
+// a helper function to announce that the calling thread may sleep in queue until
+// leave(), so queue_destroy() waits for it
+static ThreadState* enter(Queue* queue){
+    ThreadState* state = threadState();
+    atomic_store_explicit(&state->hazard->queue, queue, memory_order_release);
+    return state;
+}
+
+// a helper function to take the announcement of enter() back, once the thread is done
+// with the queue
+static void leave(ThreadState* state){
+    atomic_store_explicit(&state->hazard->queue, NULL, memory_order_release);
+}
+
+// a helper function to read a segment pointer and announce it in our hazard slot.
+// Once announced and still in place, the segment and the ones after it stay alive.
+static Segment* protect(_Atomic(Segment*)* from, Hazard* hazard){
+    Segment* segment = atomic_load(from);
+    Segment* again;
+    for (;;){
+        atomic_store(&hazard->segment, segment);
+        again = atomic_load(from);
+        if (again == segment){
+            return segment;
+        }
+        segment = again;
+    }
+}
+
+// a helper function to allocate an empty segment
+static Segment* newSegment(uint64_t id){
+    Segment* segment = calloc(1, sizeof(Segment));
+    segment->id = id;
+    return segment;
+}
+
+// a helper function to walk from segment to the one with the given id, appending the
+// missing ones
+static Segment* findSegment(Segment* segment, uint64_t id){
+    Segment* next;
+    Segment* fresh;
+    while (segment->id < id){
+        next = atomic_load_explicit(&segment->next, memory_order_acquire);
+        if (next == NULL){
+            fresh = newSegment(segment->id + 1);
+            if (atomic_compare_exchange_strong(&segment->next, &next, fresh)){
+                next = fresh;
+            }
+            else{
+                free(fresh);
+            }
+        }
+        segment = next;
+    }
+    return segment;
+}
+
+// a helper function to free the segments that both counters are past and no thread
+// announces. Only one thread reclaims at a time, the others skip it.
+static void reclaim(Queue* queue){
+    Segment* announced[MAX_THREADS];
+    Segment* head;
+    Segment* tail;
+    Segment* next;
+    uint64_t limit;
+    int i, count = 0, used;
+    if (atomic_flag_test_and_set_explicit(&queue->reclaiming, memory_order_acquire)){
+        return;
+    }
+    // read the counters' segments before the hazards, see protect()
+    head = atomic_load(&queue->head_segment);
+    tail = atomic_load(&queue->tail_segment);
+    limit = head->id < tail->id ? head->id : tail->id;
+    used = atomic_load(&hazards_used);
+    for (i = 0; i < used; i++){
+        announced[count] = atomic_load(&hazards[i].segment);
+        if (announced[count] != NULL){
+            count++;
+        }
+    }
+    while (queue->first->id < limit){
+        for (i = 0; i < count && announced[i] != queue->first; i++){
+        }
+        if (i < count){
+            break;
+        }
+        next = atomic_load(&queue->first->next);
+        free(queue->first);
+        queue->first = next;
+    }
+    atomic_flag_clear_explicit(&queue->reclaiming, memory_order_release);
+}
+
+// a helper function to get the slot of ticket, walking from *segment, an announced
+// one that is no later than the ticket's, and moving pointer along when it lags.
+// Leaves the ticket's segment in *segment, for the tickets after it.
+static Slot* ticketSlot(Queue* queue, Segment** segment, _Atomic(Segment*)* pointer,
+                        uint64_t ticket){
+    Segment* at = findSegment(*segment, ticket / SEGMENT_SLOTS);
+    Segment* current;
+    if (at != *segment){
+        // everything from the announced segment on is alive, pointer's included
+        current = atomic_load(pointer);
+        while (current->id < at->id && !atomic_compare_exchange_weak(pointer, &current, at)){
+        }
+        reclaim(queue);
+        *segment = at;
+    }
+    return &at->slots[ticket % SEGMENT_SLOTS];
+}
+
+// a helper function to fill slot with item, or hand the item to the dequeue that
+// sleeps on the slot. Returns false if the slot was abandoned.
+static bool putSlot(Slot* slot, void* item){
+    uintptr_t expected = SLOT_EMPTY;
+    Parker* parker;
+    slot->data = item;
+    if (atomic_compare_exchange_strong_explicit(&slot->state, &expected, SLOT_FULL,
+                                                memory_order_release, memory_order_acquire)){
+        return true;
+    }
+    // the sleeper may time out meanwhile, so claim the slot from it first
+    if (expected == SLOT_ABANDONED ||
+        !atomic_compare_exchange_strong(&slot->state, &expected, SLOT_FULL)){
+        return false;
+    }
+    parker = (Parker*)expected;
+    mtx_lock(&parker->mutex);
+    parker->ready = true;
+    cnd_signal(&parker->cond);
+    mtx_unlock(&parker->mutex);
+    return true;
+}
+
+// a helper function to wait for the item of slot and store it in *item. Without a
+// parker it only spins, for a slot whose enqueue already took its ticket. Returns
+// false if the TIME_UTC deadline (NULL for none) passed first, abandoning the slot.
+static bool takeSlot(Slot* slot, Parker* parker, const struct timespec* deadline, void** item){
+    uintptr_t expected = SLOT_EMPTY;
+    int result = thrd_success;
+    for (int i = 0; i < SPIN_COUNT; i++){
+        if (atomic_load_explicit(&slot->state, memory_order_acquire) == SLOT_FULL){
+            *item = slot->data;
+            return true;
+        }
+    }
+    if (parker == NULL){
+        while (atomic_load_explicit(&slot->state, memory_order_acquire) != SLOT_FULL){
+            thrd_yield();
+        }
+        *item = slot->data;
+        return true;
+    }
+    if (atomic_compare_exchange_strong_explicit(&slot->state, &expected, (uintptr_t)parker,
+                                                memory_order_release, memory_order_acquire)){
+        mtx_lock(&parker->mutex);
+        while (!parker->ready && result != thrd_timedout){
+            if (deadline == NULL){
+                cnd_wait(&parker->cond, &parker->mutex);
+            }
+            else{
+                result = cnd_timedwait(&parker->cond, &parker->mutex, deadline);
+            }
+        }
+        if (!parker->ready){
+            // give the slot up, unless its enqueue just claimed it
+            expected = (uintptr_t)parker;
+            if (atomic_compare_exchange_strong(&slot->state, &expected, SLOT_ABANDONED)){
+                mtx_unlock(&parker->mutex);
+                return false;
+            }
+            while (!parker->ready){
+                cnd_wait(&parker->cond, &parker->mutex);
+            }
+        }
+        parker->ready = false;
+        mtx_unlock(&parker->mutex);
+    }
+    *item = slot->data;
+    return true;
+}
+
+// a helper function to take up to max items whose enqueues already took their tickets,
+// without waiting, leaving out the sentinels. Returns how many it took.
+static size_t takeItems(Queue* queue, void** out, size_t max){
+    ThreadState* state = threadState();
+    Segment* segment = protect(&queue->head_segment, state->hazard);
+    uint_fast64_t ticket = atomic_load(&queue->head);
+    uint_fast64_t tail;
+    size_t count, taken = 0;
+    // only take tickets that an enqueue already took, as the ones past them are
+    // promised to the waiting threads
+    do{
+        tail = atomic_load(&queue->tail);
+        if (ticket >= tail || max == 0){
+            atomic_store_explicit(&state->hazard->segment, NULL, memory_order_release);
+            return 0;
+        }
+        count = tail - ticket < max ? tail - ticket : max;
+    } while (!atomic_compare_exchange_weak(&queue->head, &ticket, ticket + count));
+    for (size_t i = 0; i < count; i++){
+        takeSlot(ticketSlot(queue, &segment, &queue->head_segment, ticket + i), NULL, NULL, &out[taken]);
+        if (out[taken] != QUEUE_SHUTDOWN){
+            taken++;
+        }
+    }
+    atomic_store_explicit(&state->hazard->segment, NULL, memory_order_release);
+    atomic_fetch_add_explicit(&queue->total_visited, taken, memory_order_relaxed);
+    return taken;
+}
+
+// a helper function to take up to max items from the lanes, highest level first,
+// without waiting. Returns how many it took.
+static size_t takeLanes(Queue* queue, void** out, size_t max){
+    Queue* lane;
+    size_t count = 0;
+    for (int i = QUEUE_PRIORITIES - 2; i >= 0 && count < max; i--){
+        lane = atomic_load_explicit(&queue->lanes[i], memory_order_acquire);
+        if (lane != NULL){
+            count += takeItems(lane, out + count, max - count);
+        }
+    }
+    return count;
+}
+
+// a helper function to get the lane of a level above 0, creating it on first use
+static Queue* laneOf(Queue* queue, int level){
+    _Atomic(Queue*)* at = &queue->lanes[level - 1];
+    Queue* lane = atomic_load_explicit(at, memory_order_acquire);
+    Queue* expected = NULL;
+    if (lane != NULL){
+        return lane;
+    }
+    lane = queue_create();
+    if (!atomic_compare_exchange_strong(at, &expected, lane)){
+        queue_destroy(lane);
+        lane = expected;
+    }
+    return lane;
+}
+
+// a helper function to tell if a lane has an item
+static bool inLanes(Queue* queue){
+    Queue* lane;
+    for (int i = 0; i < QUEUE_PRIORITIES - 1; i++){
+        lane = atomic_load_explicit(&queue->lanes[i], memory_order_acquire);
+        if (lane != NULL && queue_size(lane) > 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+// a helper function to take a ticket and wait for its item, in *item, which is
+// QUEUE_SHUTDOWN once the queue is shut down and has no items left. Returns false if
+// the deadline (NULL for none) passed first.
+static bool takeItem(Queue* queue, const struct timespec* deadline, void** item){
+    ThreadState* state = threadState();
+    Segment* segment;
+    uint_fast64_t ticket;
+    Slot* slot;
+    uintptr_t expected;
+    bool taken, retry;
+    if (atomic_load(&queue->shutdown)){
+        // don't queue behind the sleepers that the shutdown woke
+        if (takeLanes(queue, item, 1) == 0 && takeItems(queue, item, 1) == 0){
+            *item = QUEUE_SHUTDOWN;
+        }
+        return true;
+    }
+    do{
+        if (takeLanes(queue, item, 1) == 1){
+            return true;
+        }
+        segment = protect(&queue->head_segment, state->hazard);
+        ticket = atomic_fetch_add(&queue->head, 1);
+        slot = ticketSlot(queue, &segment, &queue->head_segment, ticket);
+        expected = SLOT_EMPTY;
+        retry = false;
+        if (atomic_load(&queue->shutdown) &&
+            atomic_compare_exchange_strong(&slot->state, &expected, SLOT_ABANDONED)){
+            // the sentinels of the shutdown may have missed this ticket, don't sleep on it
+            *item = QUEUE_SHUTDOWN;
+            taken = false;
+        }
+        else if (expected == SLOT_EMPTY && inLanes(queue) &&
+                 atomic_compare_exchange_strong(&slot->state, &expected, SLOT_ABANDONED)){
+            // a priority item came after the lanes were looked in, go back for it
+            retry = true;
+        }
+        else{
+            taken = takeSlot(slot, &state->parker, deadline, item);
+        }
+        atomic_store_explicit(&state->hazard->segment, NULL, memory_order_release);
+        if (retry){
+            atomic_fetch_add(&queue->abandoned, 1);
+        }
+    } while (retry);
+    if (!taken){
+        atomic_fetch_add(&queue->abandoned, 1);
+        return *item == QUEUE_SHUTDOWN;
+    }
+    if (*item != QUEUE_SHUTDOWN){
+        atomic_fetch_add_explicit(&queue->total_visited, 1, memory_order_relaxed);
+    }
+    return true;
+}
+
+// a helper function to add n items, oldest first, taking a new ticket for each slot
+// that was abandoned
+static void putItems(Queue* queue, void** items, size_t n){
+    ThreadState* state = threadState();
+    Segment* segment = protect(&queue->tail_segment, state->hazard);
+    uint_fast64_t ticket = atomic_fetch_add(&queue->tail, n);
+    uint_fast64_t end = ticket + n;
+    size_t i = 0;
+    // the sleepers on these tickets wake in the order they came
+    while (i < n){
+        if (ticket == end){
+            ticket = atomic_fetch_add(&queue->tail, n - i);
+            end = ticket + n - i;
+        }
+        if (putSlot(ticketSlot(queue, &segment, &queue->tail_segment, ticket++), items[i])){
+            i++;
+        }
+        else{
+            atomic_fetch_sub(&queue->abandoned, 1);
+        }
+    }
+    atomic_store_explicit(&state->hazard->segment, NULL, memory_order_release);
+}
+
+// a helper function to give n permits back to a bounded queue
+static void returnPermits(Queue* queue, size_t n){
+    void* permit = PERMIT;
+    if (queue->room == NULL){
+        return;
+    }
+    for (size_t i = 0; i < n; i++){
+        putItems(queue->room, &permit, 1);
+    }
+}
+
+// ================================== initialization ==================================
+queue_t* queue_create(void) {
+    // Initialize the queue
+    Segment* segment = newSegment(0);
+    Queue* queue = aligned_alloc(_Alignof(Queue), sizeof(Queue));
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head_segment, segment);
+    atomic_init(&queue->tail_segment, segment);
+    atomic_init(&queue->total_visited, 0);
+    atomic_init(&queue->abandoned, 0);
+    atomic_flag_clear(&queue->reclaiming);
+    queue->first = segment;
+    queue->room = NULL;
+    for (int i = 0; i < QUEUE_PRIORITIES - 1; i++){
+        atomic_init(&queue->lanes[i], NULL);
+    }
+    atomic_init(&queue->shutdown, false);
+    return queue;
+}
+
+queue_t* queue_createBounded(size_t capacity) {
+    Queue* queue = queue_create();
+    if (capacity > 0){
+        queue->room = queue_create();
+        returnPermits(queue, capacity);
+    }
+    return queue;
+}
+
+void initQueue(void) {
+    default_queue = queue_create();
+}
+
+void initBoundedQueue(size_t capacity) {
+    default_queue = queue_createBounded(capacity);
+}
+
+// ================================== destruction ==================================
+void queue_shutdown(queue_t* queue){
+    void* sentinel = QUEUE_SHUTDOWN;
+    size_t sleepers;
+    if (atomic_exchange(&queue->shutdown, true)){
+        return;
+    }
+    if (queue->room != NULL){
+        queue_shutdown(queue->room);
+    }
+    // the dequeues that take their tickets from now on see the flag, so this runs out
+    while ((sleepers = queue_waiting(queue)) > 0){
+        for (size_t i = 0; i < sleepers; i++){
+            putItems(queue, &sentinel, 1);
+        }
+    }
+}
+
+void queueShutdown(void){
+    queue_shutdown(default_queue);
+}
+
+void queue_destroy(queue_t* queue){
+    // Destroy the queue, no thread may be using it but the ones sleeping in it
+    Segment* next;
+    int used;
+    if (queue == NULL){
+        return;
+    }
+    queue_shutdown(queue);
+    // wait for the woken threads to leave before their queue goes away
+    used = atomic_load(&hazards_used);
+    for (int i = 0; i < used; i++){
+        while (atomic_load_explicit(&hazards[i].queue, memory_order_acquire) == queue){
+            thrd_yield();
+        }
+    }
+    queue_destroy(queue->room);
+    for (int i = 0; i < QUEUE_PRIORITIES - 1; i++){
+        queue_destroy(atomic_load(&queue->lanes[i]));
+    }
+    while (queue->first != NULL){
+        next = atomic_load(&queue->first->next);
+        free(queue->first);
+        queue->first = next;
+    }
+    free(queue);
+}
+
+void destroyQueue(void){
+    queue_destroy(default_queue);
+    default_queue = NULL;
+}
+
+// ================================== queue operations ==================================
+void queue_enqueue(queue_t* queue, void* item){
+    queue_enqueueBatch(queue, &item, 1);
+}
+
+void queue_enqueuePriority(queue_t* queue, void* item, int level){
+    ThreadState* state;
+    void* permit;
+    Queue* lane;
+    if (level <= 0){
+        queue_enqueue(queue, item);
+        return;
+    }
+    if (level >= QUEUE_PRIORITIES){
+        level = QUEUE_PRIORITIES - 1;
+    }
+    if (atomic_load(&queue->shutdown)){
+        return;
+    }
+    if (queue->room != NULL){
+        state = enter(queue);
+        takeItem(queue->room, NULL, &permit);
+        leave(state);
+        if (permit == QUEUE_SHUTDOWN){
+            return;
+        }
+    }
+    lane = laneOf(queue, level);
+    if (queue_waiting(queue) > 0){
+        // straight to the oldest sleeper
+        putItems(queue, &item, 1);
+        return;
+    }
+    putItems(lane, &item, 1);
+    // a dequeue that took its ticket before the item was there may sleep on it, move
+    // the highest item over to it
+    if (queue_waiting(queue) > 0){
+        for (int i = QUEUE_PRIORITIES - 2; i >= 0; i--){
+            lane = atomic_load_explicit(&queue->lanes[i], memory_order_acquire);
+            if (lane != NULL && takeItems(lane, &item, 1) == 1){
+                // it is counted once the sleeper takes it
+                atomic_fetch_sub_explicit(&lane->total_visited, 1, memory_order_relaxed);
+                putItems(queue, &item, 1);
+                break;
+            }
+        }
+    }
+}
+
+bool queue_tryEnqueue(queue_t* queue, void* item){
+    void* permit;
+    if (atomic_load(&queue->shutdown)){
+        return false;
+    }
+    if (queue->room != NULL && !queue_tryDequeue(queue->room, &permit)){
+        return false;
+    }
+    putItems(queue, &item, 1);
+    return true;
+}
+
+bool queue_enqueueTimed(queue_t* queue, void* item, const struct timespec* deadline){
+    ThreadState* state;
+    void* permit = PERMIT;
+    bool added = false;
+    if (atomic_load(&queue->shutdown)){
+        return false;
+    }
+    state = enter(queue);
+    if (queue->room == NULL ||
+        (takeItem(queue->room, deadline, &permit) && permit != QUEUE_SHUTDOWN)){
+        putItems(queue, &item, 1);
+        added = true;
+    }
+    leave(state);
+    return added;
+}
+
+void queue_enqueueBatch(queue_t* queue, void** items, size_t n){
+    ThreadState* state;
+    void* permit;
+    if (atomic_load(&queue->shutdown)){
+        return;
+    }
+    if (queue->room == NULL){
+        putItems(queue, items, n);
+        return;
+    }
+    // a bounded queue takes them one by one, as permits come back
+    state = enter(queue);
+    for (size_t i = 0; i < n; i++){
+        takeItem(queue->room, NULL, &permit);
+        if (permit == QUEUE_SHUTDOWN){
+            break;
+        }
+        putItems(queue, &items[i], 1);
+    }
+    leave(state);
+}
+
+void* queue_dequeue(queue_t* queue) {
+    void* item;
+    queue_dequeueBatch(queue, &item, 1);
+    return item;
+}
+
+bool queue_dequeueTimed(queue_t* queue, void** item, const struct timespec* deadline){
+    ThreadState* state = enter(queue);
+    bool taken = takeItem(queue, deadline, item);
+    if (taken && *item != QUEUE_SHUTDOWN){
+        returnPermits(queue, 1);
+    }
+    leave(state);
+    return taken;
+}
+
+size_t queue_dequeueBatch(queue_t* queue, void** out, size_t max) {
+    ThreadState* state;
+    size_t count = 0;
+    if (max == 0){
+        return 0;
+    }
+    state = enter(queue);
+    takeItem(queue, NULL, &out[0]);
+    if (out[0] != QUEUE_SHUTDOWN){
+        count = 1 + takeLanes(queue, out + 1, max - 1);
+        count += takeItems(queue, out + count, max - count);
+        returnPermits(queue, count);
+    }
+    leave(state);
+    return count;
+}
+
+bool queue_tryDequeue(queue_t* queue, void** item) {
+    return queue_tryDequeueBatch(queue, item, 1) == 1;
+}
+
+size_t queue_tryDequeueBatch(queue_t* queue, void** out, size_t max) {
+    size_t count = takeLanes(queue, out, max);
+    count += takeItems(queue, out + count, max - count);
+    returnPermits(queue, count);
+    return count;
+}
+
+void enqueue(void* item){
+    queue_enqueue(default_queue, item);
+}
+
+void enqueuePriority(void* item, int level){
+    queue_enqueuePriority(default_queue, item, level);
+}
+
+bool tryEnqueue(void* item){
+    return queue_tryEnqueue(default_queue, item);
+}
+
+bool enqueueTimed(void* item, const struct timespec* deadline){
+    return queue_enqueueTimed(default_queue, item, deadline);
+}
+
+void enqueueBatch(void** items, size_t n){
+    queue_enqueueBatch(default_queue, items, n);
+}
+
+void* dequeue(void) {
+    return queue_dequeue(default_queue);
+}
+
+bool dequeueTimed(void** item, const struct timespec* deadline) {
+    return queue_dequeueTimed(default_queue, item, deadline);
+}
+
+size_t dequeueBatch(void** out, size_t max) {
+    return queue_dequeueBatch(default_queue, out, max);
+}
+
+bool tryDequeue(void** item) {
+    return queue_tryDequeue(default_queue, item);
+}
+
+size_t tryDequeueBatch(void** out, size_t max) {
+    return queue_tryDequeueBatch(default_queue, out, max);
+}
+
+// ================================== queue information ==================================//
+size_t queue_size(queue_t* queue) {
+    int_fast64_t abandoned = atomic_load(&queue->abandoned);
+    uint_fast64_t tail = atomic_load(&queue->tail);
+    uint_fast64_t head = atomic_load(&queue->head);
+    int_fast64_t size = (int_fast64_t)(tail - head) + abandoned;
+    size_t lanes = 0;
+    Queue* lane;
+    for (int i = 0; i < QUEUE_PRIORITIES - 1; i++){
+        lane = atomic_load_explicit(&queue->lanes[i], memory_order_acquire);
+        if (lane != NULL){
+            lanes += queue_size(lane);
+        }
+    }
+    return (size > 0 ? (size_t)size : 0) + lanes;
+}
+
+size_t queue_waiting(queue_t* queue) {
+    uint_fast64_t head = atomic_load(&queue->head);
+    uint_fast64_t tail = atomic_load(&queue->tail);
+    int_fast64_t abandoned = atomic_load(&queue->abandoned);
+    int_fast64_t waiting = (int_fast64_t)(head - tail) - abandoned;
+    return waiting > 0 ? (size_t)waiting : 0;
+}
+
+size_t queue_visited(queue_t* queue) {
+    // no locks
+    size_t visited = atomic_load_explicit(&queue->total_visited, memory_order_relaxed);
+    Queue* lane;
+    for (int i = 0; i < QUEUE_PRIORITIES - 1; i++){
+        lane = atomic_load_explicit(&queue->lanes[i], memory_order_acquire);
+        if (lane != NULL){
+            visited += queue_visited(lane);
+        }
+    }
+    return visited;
+}
+
+size_t size(void) {
+    return queue_size(default_queue);
+}
+
+size_t waiting(void) {
+    return queue_waiting(default_queue);
+}
+
+size_t visited(void) {
+    return queue_visited(default_queue);
+}
+
+void queueStatsDump(void) {
+    printf("the lock-free queue keeps no stats\n");
+}
+
+uint64_t queueStatsCount(int stat) {
+    (void)stat;
+    return 0;
+}
@@ -0,0 +1,344 @@
+#include "queue_sharded.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+// A sharded queue that gives up the global FIFO order of queue.h for throughput.
+//
+// Every thread that uses a queue gets a shard of it, a Chase-Lev deque that only the
+// thread pushes to and pops from, at its bottom, while the other threads steal from its
+// top with a compare-and-swap. An enqueue or a dequeue that finds its own shard full
+// touches no cache line that another thread writes, unless a thief takes the shard's
+// last item. The shards count their own dequeues, and the sizes and counts are added
+// up when they are read.
+//
+// A thread that finds all MAX_SHARDS ids in use has no shard until one is given back:
+// its enqueues fail and its dequeues only steal, counted in the queue's own count.
+//
+// A dequeue that finds every shard empty sleeps on the queue's condition variable. It
+// announces itself before it looks a last time, and an enqueue only takes the lock
+// when someone sleeps.
+
+#define MAX_SHARDS 1024         // threads using sharded queues at the same time
+#define FIRST_SIZE 64           // slots of a shard's first array
+
+#define STEAL_EMPTY 0
+#define STEAL_TAKEN 1
+#define STEAL_RETRY 2           // lost the item to another thread, the shard may have more
+
+// ================================== data structures ==================================//
+// Array structure, the ring of a shard. Replaced by one twice as big when full, and
+// kept until the queue is destroyed, as thieves may still read the old one.
+typedef struct Array {
+    int64_t size;
+    struct Array* retired;      // the array this one replaced
+    _Atomic(void*) items[];
+} Array;
+// Shard structure, the deque of one thread
+typedef struct Shard {
+    _Alignas(64) atomic_int_fast64_t top;       // next item to steal
+    _Alignas(64) atomic_int_fast64_t bottom;    // next slot to push to
+    _Atomic(Array*) array;
+    atomic_size_t visited;                      // items the owner dequeued
+} Shard;
+// Sharded structure, behind a sharded_t handle
+typedef struct Sharded {
+    _Atomic(Shard*) shards[MAX_SHARDS];         // by thread id, created on first use
+    atomic_int count;                           // the shards in use are below it
+    atomic_size_t visited;                      // items dequeued by threads without a shard
+    _Alignas(64) atomic_int sleepers;
+    mtx_t mutex;
+    cnd_t cond;
+    unsigned epoch;                             // bumped by every wakeup
+} Sharded;
+
+// ================================== global variables ==================================//
+static atomic_bool ids_used[MAX_SHARDS];
+static tss_t id_key;
+static once_flag id_once = ONCE_FLAG_INIT;
+static thread_local int id = -1;
+
+// ================================= helper functions =================================
+
+// a helper function to give a finished thread's id back. Its shards keep their items
+// for the next thread with the id.
+static void freeId(void* arg){
+    atomic_store(&ids_used[(intptr_t)arg - 1], false);
+}
+
+// a helper function to create the key of freeId()
+static void makeIdKey(void){
+    tss_create(&id_key, freeId);
+}
+
+// a helper function to get the calling thread's id, -1 while every id is in use
+static int threadId(void){
+    int i;
+    if (id >= 0){
+        return id;
+    }
+    call_once(&id_once, makeIdKey);
+    for (i = 0; i < MAX_SHARDS; i++){
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ids_used[i], &expected, true)){
+            break;
+        }
+    }
+    if (i == MAX_SHARDS){
+        return -1;
+    }
+    // a NULL value would not call freeId()
+    tss_set(id_key, (void*)(intptr_t)(i + 1));
+    id = i;
+    return id;
+}
+
+// a helper function to allocate an empty array of size slots
+static Array* newArray(int64_t size, Array* retired){
+    Array* array = malloc(sizeof(Array) + size * sizeof(void*));
+    array->size = size;
+    array->retired = retired;
+    return array;
+}
+
+// a helper function to get the calling thread's shard, creating it on first use.
+// Returns NULL if the thread has no id.
+static Shard* ownShard(Sharded* queue){
+    int i = threadId();
+    Shard* shard;
+    int count;
+    if (i < 0){
+        return NULL;
+    }
+    shard = atomic_load_explicit(&queue->shards[i], memory_order_acquire);
+    if (shard != NULL){
+        return shard;
+    }
+    shard = aligned_alloc(_Alignof(Shard), sizeof(Shard));
+    atomic_init(&shard->top, 0);
+    atomic_init(&shard->bottom, 0);
+    atomic_init(&shard->array, newArray(FIRST_SIZE, NULL));
+    atomic_init(&shard->visited, 0);
+    atomic_store_explicit(&queue->shards[i], shard, memory_order_release);
+    count = atomic_load(&queue->count);
+    while (count <= i && !atomic_compare_exchange_weak(&queue->count, &count, i + 1)){
+    }
+    return shard;
+}
+
+// a helper function to push item at the bottom of the calling thread's shard
+static void push(Shard* shard, void* item){
+    int_fast64_t bottom = atomic_load_explicit(&shard->bottom, memory_order_relaxed);
+    int_fast64_t top = atomic_load_explicit(&shard->top, memory_order_acquire);
+    Array* array = atomic_load_explicit(&shard->array, memory_order_relaxed);
+    Array* bigger;
+    if (bottom - top > array->size - 1){
+        bigger = newArray(array->size * 2, array);
+        for (int_fast64_t i = top; i < bottom; i++){
+            atomic_store_explicit(&bigger->items[i % bigger->size],
+                atomic_load_explicit(&array->items[i % array->size], memory_order_relaxed),
+                memory_order_relaxed);
+        }
+        atomic_store_explicit(&shard->array, bigger, memory_order_release);
+        array = bigger;
+    }
+    atomic_store_explicit(&array->items[bottom % array->size], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&shard->bottom, bottom + 1, memory_order_relaxed);
+}
+
+// a helper function to pop the newest item of the calling thread's shard. Returns false
+// if it is empty.
+static bool pop(Shard* shard, void** item){
+    int_fast64_t bottom = atomic_load_explicit(&shard->bottom, memory_order_relaxed) - 1;
+    Array* array = atomic_load_explicit(&shard->array, memory_order_relaxed);
+    int_fast64_t top;
+    bool taken = true;
+    atomic_store_explicit(&shard->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&shard->top, memory_order_relaxed);
+    if (top > bottom){
+        atomic_store_explicit(&shard->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+    *item = atomic_load_explicit(&array->items[bottom % array->size], memory_order_relaxed);
+    if (top == bottom){
+        // the last item, race the thieves for it
+        taken = atomic_compare_exchange_strong_explicit(&shard->top, &top, top + 1,
+                                                        memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&shard->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return taken;
+}
+
+// a helper function to steal the oldest item of another thread's shard
+static int steal(Shard* shard, void** item){
+    int_fast64_t top = atomic_load_explicit(&shard->top, memory_order_acquire);
+    int_fast64_t bottom;
+    Array* array;
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&shard->bottom, memory_order_acquire);
+    if (top >= bottom){
+        return STEAL_EMPTY;
+    }
+    array = atomic_load_explicit(&shard->array, memory_order_acquire);
+    *item = atomic_load_explicit(&array->items[top % array->size], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&shard->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)){
+        return STEAL_RETRY;
+    }
+    return STEAL_TAKEN;
+}
+
+// a helper function to steal an item from the other shards, starting after own's (-1
+// for a thread without a shard)
+static bool stealAny(Sharded* queue, int own, void** item){
+    int count = atomic_load(&queue->count);
+    bool retry = true;
+    Shard* shard;
+    while (retry){
+        retry = false;
+        for (int i = own < 0 ? 0 : 1; i < count; i++){
+            shard = atomic_load_explicit(&queue->shards[(own + count + i) % count],
+                                         memory_order_acquire);
+            if (shard == NULL){
+                continue;
+            }
+            switch (steal(shard, item)){
+                case STEAL_TAKEN:
+                    return true;
+                case STEAL_RETRY:
+                    retry = true;
+                    break;
+            }
+        }
+    }
+    return false;
+}
+
+// ================================== initialization ==================================
+sharded_t* sharded_create(void) {
+    Sharded* queue = aligned_alloc(_Alignof(Sharded), sizeof(Sharded));
+    for (int i = 0; i < MAX_SHARDS; i++){
+        atomic_init(&queue->shards[i], NULL);
+    }
+    atomic_init(&queue->count, 0);
+    atomic_init(&queue->visited, 0);
+    atomic_init(&queue->sleepers, 0);
+    mtx_init(&queue->mutex, mtx_plain);
+    cnd_init(&queue->cond);
+    queue->epoch = 0;
+    return queue;
+}
+
+// ================================== destruction ==================================
+void sharded_destroy(sharded_t* queue){
+    // Destroy the queue, no thread may be using it
+    Shard* shard;
+    Array* array;
+    Array* retired;
+    if (queue == NULL){
+        return;
+    }
+    for (int i = 0; i < atomic_load(&queue->count); i++){
+        shard = atomic_load(&queue->shards[i]);
+        if (shard == NULL){
+            continue;
+        }
+        for (array = atomic_load(&shard->array); array != NULL; array = retired){
+            retired = array->retired;
+            free(array);
+        }
+        free(shard);
+    }
+    mtx_destroy(&queue->mutex);
+    cnd_destroy(&queue->cond);
+    free(queue);
+}
+
+// ================================== queue operations ==================================
+bool sharded_enqueue(sharded_t* queue, void* item){
+    Shard* shard = ownShard(queue);
+    if (shard == NULL){
+        return false;
+    }
+    push(shard, item);
+    // pairs with the fence of the sleepers between announcing themselves and looking
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->sleepers, memory_order_relaxed) > 0){
+        mtx_lock(&queue->mutex);
+        queue->epoch++;
+        cnd_signal(&queue->cond);
+        mtx_unlock(&queue->mutex);
+    }
+    return true;
+}
+
+bool sharded_tryDequeue(sharded_t* queue, void** item){
+    Shard* shard = ownShard(queue);
+    if (shard == NULL){
+        if (!stealAny(queue, -1, item)){
+            return false;
+        }
+        atomic_fetch_add_explicit(&queue->visited, 1, memory_order_relaxed);
+        return true;
+    }
+    if (!pop(shard, item) && !stealAny(queue, id, item)){
+        return false;
+    }
+    // only the owner writes the count
+    atomic_store_explicit(&shard->visited,
+        atomic_load_explicit(&shard->visited, memory_order_relaxed) + 1, memory_order_relaxed);
+    return true;
+}
+
+void* sharded_dequeue(sharded_t* queue){
+    void* item;
+    unsigned epoch;
+    while (!sharded_tryDequeue(queue, &item)){
+        // an enqueue after this point bumps the epoch, or is found by the last look
+        mtx_lock(&queue->mutex);
+        epoch = queue->epoch;
+        mtx_unlock(&queue->mutex);
+        atomic_fetch_add(&queue->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sharded_tryDequeue(queue, &item)){
+            atomic_fetch_sub(&queue->sleepers, 1);
+            return item;
+        }
+        mtx_lock(&queue->mutex);
+        while (queue->epoch == epoch){
+            cnd_wait(&queue->cond, &queue->mutex);
+        }
+        mtx_unlock(&queue->mutex);
+        atomic_fetch_sub(&queue->sleepers, 1);
+    }
+    return item;
+}
+
+// ================================== queue information ==================================//
+size_t sharded_size(sharded_t* queue){
+    Shard* shard;
+    int_fast64_t size = 0, items;
+    for (int i = 0; i < atomic_load(&queue->count); i++){
+        shard = atomic_load_explicit(&queue->shards[i], memory_order_acquire);
+        if (shard != NULL){
+            items = atomic_load(&shard->bottom) - atomic_load(&shard->top);
+            size += items > 0 ? items : 0;
+        }
+    }
+    return (size_t)size;
+}
+
+size_t sharded_visited(sharded_t* queue){
+    Shard* shard;
+    size_t visited = atomic_load_explicit(&queue->visited, memory_order_relaxed);
+    for (int i = 0; i < atomic_load(&queue->count); i++){
+        shard = atomic_load_explicit(&queue->shards[i], memory_order_acquire);
+        if (shard != NULL){
+            visited += atomic_load_explicit(&shard->visited, memory_order_relaxed);
+        }
+    }
+    return visited;
+}
@@ -0,0 +1,18 @@
+#include <stddef.h>
+#include <stdbool.h>
+/* A sharded queue for consumers that don't need one global FIFO order. Each thread
+ * enqueues into a shard of its own and dequeues from it first, newest item first, then
+ * steals the oldest items of the other shards. sharded_dequeue() blocks until there
+ * is an item anywhere. The counts are summed over the shards when read, so they are
+ * only exact while no thread uses the queue. Shards go to the first 1024 threads that
+ * use a sharded queue at a time: a thread beyond them fails to enqueue, with
+ * sharded_enqueue() returning false and the item left to the caller, and dequeues
+ * only by stealing. */
+typedef struct Sharded sharded_t;
+sharded_t* sharded_create(void);
+void sharded_destroy(sharded_t* q);
+bool sharded_enqueue(sharded_t* q, void* item);
+void* sharded_dequeue(sharded_t* q);
+bool sharded_tryDequeue(sharded_t* q, void** item);
+size_t sharded_size(sharded_t* q);
+size_t sharded_visited(sharded_t* q);
@@ -3,6 +3,7 @@
 #include <threads.h>
 #include <stdatomic.h>
 #include <assert.h>
+#include <malloc.h>
 #include "queue.h"
 
 int count_failed = 0;
@@ -423,7 +424,541 @@ void test_thread_wakeup_order() {
     destroyQueue();
 }
 
+// Function to test batch operations
+void test_batch_operations() {
+    initQueue();
+
+    const int num_items = 100;
+    void *items[num_items];
+    void *out[num_items];
+    for (int i = 0; i < num_items; ++i) {
+        items[i] = (void *)(long)i;
+    }
+
+    // Enqueue all items at once, then take them back in two batches
+    enqueueBatch(items, num_items);
+    print_result("Batch Operations - Size after enqueueBatch", size() == num_items);
+    if (size() != num_items) {
+        count_failed++;
+    }
+
+    bool batch_order_correct = dequeueBatch(out, 40) == 40;
+    for (int i = 0; batch_order_correct && i < 40; ++i) {
+        batch_order_correct = (long)out[i] == i;
+    }
+    batch_order_correct = batch_order_correct && tryDequeueBatch(out, num_items) == num_items - 40;
+    for (int i = 0; batch_order_correct && i < num_items - 40; ++i) {
+        batch_order_correct = (long)out[i] == i + 40;
+    }
+    print_result("Batch Operations - FIFO order", batch_order_correct);
+    if (!batch_order_correct) {
+        count_failed++;
+    }
+
+    print_result("Batch Operations - TryDequeueBatch on empty queue", tryDequeueBatch(out, num_items) == 0);
+    if (tryDequeueBatch(out, num_items) != 0) {
+        count_failed++;
+    }
+
+    // One enqueueBatch wakes every waiting thread it has an item for
+    const int num_threads = 3;
+    thrd_t threads[num_threads];
+    atomic_size_t woken = ATOMIC_VAR_INIT(0);
+
+    int dequeue_thread(void *arg) {
+        (void)arg;
+        dequeue();
+        atomic_fetch_add(&woken, 1);
+        return 0;
+    }
+
+    for (int i = 0; i < num_threads; ++i) {
+        thrd_create(&threads[i], dequeue_thread, NULL);
+    }
+    thrd_sleep(&(struct timespec){.tv_sec = 1, .tv_nsec = 0}, NULL);
+    enqueueBatch(items, num_threads + 2);
+    for (int i = 0; i < num_threads; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+
+    bool batch_wakeup_correct = woken == num_threads && size() == 2 && waiting() == 0;
+    print_result("Batch Operations - EnqueueBatch wakes waiting threads", batch_wakeup_correct);
+    if (!batch_wakeup_correct) {
+        count_failed++;
+    }
+
+    print_result("Batch Operations - Visited", visited() == num_items + num_threads);
+    if (visited() != num_items + num_threads) {
+        count_failed++;
+    }
+
+    destroyQueue();
+}
+
+// Function to test independent queue instances
+void test_multiple_instances() {
+    initQueue();
+    queue_t *first = queue_create();
+    queue_t *second = queue_create();
+
+    // Each queue keeps its own items in its own order
+    for (long i = 0; i < 10; ++i) {
+        queue_enqueue(first, (void *)i);
+        queue_enqueue(second, (void *)(100 + i));
+    }
+    enqueue((void *)(long)1000);
+    bool sizes_correct = queue_size(first) == 10 && queue_size(second) == 10 && size() == 1;
+    print_result("Multiple Instances - Independent sizes", sizes_correct);
+    if (!sizes_correct) {
+        count_failed++;
+    }
+
+    bool order_correct = true;
+    for (long i = 0; i < 10; ++i) {
+        order_correct = order_correct && (long)queue_dequeue(second) == 100 + i;
+        order_correct = order_correct && (long)queue_dequeue(first) == i;
+    }
+    order_correct = order_correct && (long)dequeue() == 1000;
+    print_result("Multiple Instances - FIFO order per queue", order_correct);
+    if (!order_correct) {
+        count_failed++;
+    }
+
+    // A thread waiting on one queue is not woken by items of another
+    thrd_t thread;
+    bool thread_finished = false;
+
+    int dequeue_thread(void *arg) {
+        (void)arg;
+        queue_dequeue(first);
+        thread_finished = true;
+        return 0;
+    }
+
+    thrd_create(&thread, dequeue_thread, NULL);
+    thrd_sleep(&(struct timespec){.tv_sec = 1, .tv_nsec = 0}, NULL);
+    queue_enqueue(second, (void *)(long)1);
+    enqueue((void *)(long)2);
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 100000000}, NULL);
+    bool still_waiting = !thread_finished && queue_waiting(first) == 1 && queue_waiting(second) == 0;
+    print_result("Multiple Instances - Waiting threads per queue", still_waiting);
+    if (!still_waiting) {
+        count_failed++;
+    }
+
+    queue_enqueue(first, (void *)(long)3);
+    thrd_join(thread, NULL);
+    bool visited_correct = queue_visited(first) == 11 && queue_visited(second) == 10 && visited() == 1;
+    print_result("Multiple Instances - Visited per queue", visited_correct);
+    if (!visited_correct) {
+        count_failed++;
+    }
+
+    queue_destroy(first);
+    queue_destroy(second);
+    destroyQueue();
+}
+
+// Function to test a bounded queue
+void test_bounded_queue() {
+    const int capacity = 4;
+    initBoundedQueue(capacity);
+
+    for (long i = 0; i < capacity; ++i) {
+        enqueue((void *)i);
+    }
+    bool full_rejects = !tryEnqueue((void *)(long)-1) && size() == capacity;
+    print_result("Bounded Queue - TryEnqueue on full queue", full_rejects);
+    if (!full_rejects) {
+        count_failed++;
+    }
+
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += 100000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    bool timed_out = !enqueueTimed((void *)(long)-1, &deadline) && size() == capacity;
+    print_result("Bounded Queue - EnqueueTimed on full queue times out", timed_out);
+    if (!timed_out) {
+        count_failed++;
+    }
+
+    // Blocked producers get in once there is room, in the order they came
+    const int num_threads = 2;
+    thrd_t threads[num_threads];
+    atomic_size_t finished = ATOMIC_VAR_INIT(0);
+
+    int enqueue_thread(void *arg) {
+        enqueue(arg);
+        atomic_fetch_add(&finished, 1);
+        return 0;
+    }
+
+    for (long i = 0; i < num_threads; ++i) {
+        thrd_create(&threads[i], enqueue_thread, (void *)(100 + i));
+        thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 200000000}, NULL);
+    }
+    print_result("Bounded Queue - Enqueue on full queue blocks", finished == 0);
+    if (finished != 0) {
+        count_failed++;
+    }
+
+    bool order_correct = true;
+    for (long i = 0; i < capacity + num_threads; ++i) {
+        long expected = i < capacity ? i : 100 + i - capacity;
+        if ((long)dequeue() != expected) {
+            order_correct = false;
+        }
+    }
+    for (int i = 0; i < num_threads; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    order_correct = order_correct && size() == 0 && tryEnqueue((void *)(long)1);
+    print_result("Bounded Queue - Blocked producers in FIFO order", order_correct);
+    if (!order_correct) {
+        count_failed++;
+    }
+
+    destroyQueue();
+}
+
+// Function to test timed dequeues and shutting a queue down
+void test_timed_dequeue_and_shutdown() {
+    initQueue();
+
+    // A thread that times out between two waiting threads leaves them in order
+    thrd_t threads[3];
+    long results[3];
+    bool timed_out = false;
+
+    int dequeue_thread(void *arg) {
+        results[(long)arg] = (long)dequeue();
+        return 0;
+    }
+
+    int timed_thread(void *arg) {
+        (void)arg;
+        struct timespec deadline;
+        void *item;
+        timespec_get(&deadline, TIME_UTC);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        timed_out = !dequeueTimed(&item, &deadline);
+        return 0;
+    }
+
+    thrd_create(&threads[0], dequeue_thread, (void *)0L);
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 50000000}, NULL);
+    thrd_create(&threads[1], timed_thread, NULL);
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 20000000}, NULL);
+    thrd_create(&threads[2], dequeue_thread, (void *)2L);
+    thrd_join(threads[1], NULL);
+    bool left = timed_out && waiting() == 2;
+    print_result("Timed Dequeue - Times out from the middle of the waiting threads", left);
+    if (!left) {
+        count_failed++;
+    }
+
+    enqueue((void *)(long)1);
+    enqueue((void *)(long)2);
+    thrd_join(threads[0], NULL);
+    thrd_join(threads[2], NULL);
+    bool order_correct = results[0] == 1 && results[2] == 2 && size() == 0;
+    print_result("Timed Dequeue - Remaining threads woken in order", order_correct);
+    if (!order_correct) {
+        count_failed++;
+    }
+
+    // Shutting down wakes the waiting threads, after the items left are taken
+    thrd_create(&threads[0], dequeue_thread, (void *)0L);
+    thrd_create(&threads[2], dequeue_thread, (void *)2L);
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 50000000}, NULL);
+    queueShutdown();
+    thrd_join(threads[0], NULL);
+    thrd_join(threads[2], NULL);
+    bool woken = results[0] == (long)QUEUE_SHUTDOWN && results[2] == (long)QUEUE_SHUTDOWN;
+    print_result("Shutdown - Waiting threads woken", woken);
+    if (!woken) {
+        count_failed++;
+    }
+
+    destroyQueue();
+    initQueue();
+    enqueue((void *)(long)1);
+    queueShutdown();
+    enqueue((void *)(long)2);
+    void *item = NULL;
+    bool drained = (long)dequeue() == 1 && dequeue() == QUEUE_SHUTDOWN &&
+                   dequeueTimed(&item, NULL) && item == QUEUE_SHUTDOWN && size() == 0;
+    print_result("Shutdown - Items left are dequeued, new ones dropped", drained);
+    if (!drained) {
+        count_failed++;
+    }
+
+    // destroyQueue() shuts down a queue with threads still waiting
+    thrd_create(&threads[0], dequeue_thread, (void *)0L);
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 50000000}, NULL);
+    destroyQueue();
+    thrd_join(threads[0], NULL);
+    print_result("Shutdown - Destroy wakes waiting threads", results[0] == (long)QUEUE_SHUTDOWN);
+    if (results[0] != (long)QUEUE_SHUTDOWN) {
+        count_failed++;
+    }
+}
+
+// Function to test priority lanes
+void test_priority_lanes() {
+    initQueue();
+
+    // The highest level is served first, each level in FIFO order
+    enqueue((void *)(long)1);
+    enqueuePriority((void *)(long)2, 2);
+    enqueuePriority((void *)(long)3, 1);
+    enqueuePriority((void *)(long)4, 2);
+    enqueue((void *)(long)5);
+    bool size_correct = size() == 5;
+    void *item = NULL;
+    bool order_correct = (long)dequeue() == 2 && tryDequeue(&item) && (long)item == 4;
+    void *batch[3];
+    order_correct = order_correct && dequeueBatch(batch, 3) == 3 && (long)batch[0] == 3 &&
+                    (long)batch[1] == 1 && (long)batch[2] == 5;
+    print_result("Priority Lanes - Highest level first", size_correct && order_correct && size() == 0);
+    if (!size_correct || !order_correct || size() != 0) {
+        count_failed++;
+    }
+
+    // Levels out of range are clamped
+    enqueue((void *)(long)1);
+    enqueuePriority((void *)(long)2, -5);
+    enqueuePriority((void *)(long)3, QUEUE_PRIORITIES - 1);
+    enqueuePriority((void *)(long)4, 99);
+    bool clamped = (long)dequeue() == 3 && (long)dequeue() == 4 && (long)dequeue() == 1 &&
+                   (long)dequeue() == 2;
+    print_result("Priority Lanes - Levels out of range clamped", clamped);
+    if (!clamped) {
+        count_failed++;
+    }
+
+    // Waiting threads still get their items in the order they came
+    thrd_t threads[2];
+    long results[2];
+    int dequeue_thread(void *arg) {
+        results[(long)arg] = (long)dequeue();
+        return 0;
+    }
+    for (long i = 0; i < 2; ++i) {
+        thrd_create(&threads[i], dequeue_thread, (void *)i);
+        while (waiting() < (size_t)i + 1) {
+            thrd_yield();
+        }
+    }
+    enqueue((void *)(long)1);
+    enqueuePriority((void *)(long)2, 3);
+    for (int i = 0; i < 2; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    bool fair = results[0] == 1 && results[1] == 2;
+    print_result("Priority Lanes - Waiting threads served in order", fair);
+    if (!fair) {
+        count_failed++;
+    }
+    destroyQueue();
+
+    // Priority items count against the capacity of a bounded queue
+    initBoundedQueue(2);
+    enqueue((void *)(long)1);
+    enqueuePriority((void *)(long)2, 1);
+    bool bounded = !tryEnqueue((void *)(long)3) && (long)dequeue() == 2 &&
+                   tryEnqueue((void *)(long)3) && (long)dequeue() == 1 && (long)dequeue() == 3;
+    print_result("Priority Lanes - Bounded by capacity", bounded);
+    if (!bounded) {
+        count_failed++;
+    }
+    destroyQueue();
+}
+
+// Function to test the nodes and waiting state that threads keep between calls, as
+// threads come and go
+void test_thread_caches() {
+    queue_t *q = queue_create();
+    const int rounds = 20;
+    const long per_round = 300;     // more than a thread keeps, so batches pass between threads
+    atomic_bool in_order = true;
+    atomic_bool timed_out = true;
+
+    int producer_thread(void *arg) {
+        for (long i = 0; i < per_round; ++i) {
+            queue_enqueue(q, (void *)((long)arg * per_round + i + 1));
+        }
+        return 0;
+    }
+    int consumer_thread(void *arg) {
+        // a wait that times out first, then waits that are woken by the producer
+        struct timespec deadline;
+        void *item;
+        timespec_get(&deadline, TIME_UTC);
+        deadline.tv_nsec += 10000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (queue_dequeueTimed(q, &item, &deadline)) {
+            atomic_store(&timed_out, false);
+        }
+        for (long i = 0; i < per_round; ++i) {
+            if ((long)queue_dequeue(q) != (long)arg * per_round + i + 1) {
+                atomic_store(&in_order, false);
+            }
+        }
+        return 0;
+    }
+
+    bool counts_correct = true;
+    size_t in_use = 0;
+    for (long round = 0; round < rounds; ++round) {
+        thrd_t producer, consumer;
+        thrd_create(&consumer, consumer_thread, (void *)round);
+        thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 20000000}, NULL);
+        thrd_create(&producer, producer_thread, (void *)round);
+        thrd_join(producer, NULL);
+        thrd_join(consumer, NULL);
+        counts_correct = counts_correct && queue_size(q) == 0 && queue_waiting(q) == 0 &&
+                         queue_visited(q) == (size_t)((round + 1) * per_round);
+        if (round == rounds / 2) {
+            in_use = mallinfo2().uordblks;
+        }
+    }
+    // the finished threads gave back all they kept, so memory stopped growing
+    bool released = mallinfo2().uordblks == in_use;
+    print_result("Thread Caches - Finished threads release their nodes", released);
+    if (!released) {
+        count_failed++;
+    }
+    // the nodes the finished threads handed back serve this thread too
+    for (long i = 0; i < per_round; ++i) {
+        queue_enqueue(q, (void *)(i + 1));
+    }
+    for (long i = 0; i < per_round; ++i) {
+        if ((long)queue_dequeue(q) != i + 1) {
+            atomic_store(&in_order, false);
+        }
+    }
+    bool reused = atomic_load(&in_order) && atomic_load(&timed_out) && counts_correct &&
+                  queue_visited(q) == (size_t)((rounds + 1) * per_round);
+    print_result("Thread Caches - Threads that come and go reuse nodes and wait again", reused);
+    if (!reused) {
+        count_failed++;
+    }
+    queue_destroy(q);
+}
+
+#ifdef QUEUE_STATS
+// Function to test the stats of queue.c against a known workload
+void test_stats() {
+    uint64_t before[QUEUE_STAT_WAKEUPS + 1];
+    uint64_t delta[QUEUE_STAT_WAKEUPS + 1];
+    void *items[10], *out[30], *item;
+
+    void snapshot() {
+        for (int i = 0; i <= QUEUE_STAT_WAKEUPS; ++i) {
+            before[i] = queueStatsCount(i);
+        }
+    }
+    void difference() {
+        for (int i = 0; i <= QUEUE_STAT_WAKEUPS; ++i) {
+            delta[i] = queueStatsCount(i) - before[i];
+        }
+    }
+
+    // A batch counts every item it enqueues, and every lock taken is held once
+    queue_t *q = queue_create();
+    for (int i = 0; i < 10; ++i) {
+        items[i] = (void *)(long)(i + 1);
+    }
+    snapshot();
+    for (int i = 0; i < 3; ++i) {
+        queue_enqueueBatch(q, items, 10);
+    }
+    size_t taken = queue_dequeueBatch(q, out, 30);
+    bool empty = !queue_tryDequeue(q, &item);
+    difference();
+    bool batch_counts = taken == 30 && empty && delta[QUEUE_STAT_ENQUEUE] == 30 &&
+                        delta[QUEUE_STAT_DEQUEUE] == 1 && delta[QUEUE_STAT_TRY_DEQUEUE] == 1 &&
+                        delta[QUEUE_STAT_ITEM] == 30 && delta[QUEUE_STAT_LOCK_WAIT] == 5 &&
+                        delta[QUEUE_STAT_LOCK_HOLD] == 5 && delta[QUEUE_STAT_WAKEUPS] == 0;
+    print_result("Stats - Batch items and lock holds", batch_counts);
+    if (!batch_counts) {
+        count_failed++;
+    }
+    queue_destroy(q);
+
+    // A wait on the queue's mutex ends one hold and starts another
+    queue_t *bounded = queue_createBounded(1);
+    int producer_thread(void *arg) {
+        (void)arg;
+        queue_enqueue(bounded, (void *)(long)2);
+        return 0;
+    }
+    thrd_t producer;
+    snapshot();
+    queue_enqueue(bounded, (void *)(long)1);
+    thrd_create(&producer, producer_thread, NULL);
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 50000000}, NULL);
+    bool in_order = (long)queue_dequeue(bounded) == 1;
+    thrd_join(producer, NULL);
+    in_order = in_order && (long)queue_dequeue(bounded) == 2;
+    difference();
+    bool wait_counts = in_order && delta[QUEUE_STAT_ENQUEUE] == 2 && delta[QUEUE_STAT_ITEM] == 2 &&
+                       delta[QUEUE_STAT_LOCK_WAIT] == 4 && delta[QUEUE_STAT_WAKEUPS] >= 1 &&
+                       delta[QUEUE_STAT_LOCK_HOLD] == 4 + delta[QUEUE_STAT_WAKEUPS];
+    print_result("Stats - Lock holds around waits", wait_counts);
+    if (!wait_counts) {
+        count_failed++;
+    }
+    queue_destroy(bounded);
+}
+#endif
+
+// Function to test more threads at once than the lock-free queue has hazard slots for
+void test_many_threads() {
+    queue_t *q = queue_create();
+    const int num_threads = 1100;
+    thrd_t threads[num_threads];
+    atomic_long sum = 0;
+
+    int consumer_thread(void *arg) {
+        (void)arg;
+        atomic_fetch_add(&sum, (long)queue_dequeue(q));
+        return 0;
+    }
+
+    for (int i = 0; i < num_threads; ++i) {
+        thrd_create(&threads[i], consumer_thread, NULL);
+    }
+    for (long i = 1; i <= num_threads; ++i) {
+        queue_enqueue(q, (void *)i);
+    }
+    for (int i = 0; i < num_threads; ++i) {
+        thrd_join(threads[i], NULL);
+    }
+    bool all_served = atomic_load(&sum) == (long)num_threads * (num_threads + 1) / 2 &&
+                      queue_size(q) == 0 && queue_visited(q) == (size_t)num_threads;
+    print_result("Many Threads - Every consumer served", all_served);
+    if (!all_served) {
+        count_failed++;
+    }
+    queue_destroy(q);
+}
+
 int main() {
+    // one malloc arena for every thread, so mallinfo2() sees all of their memory
+    mallopt(M_ARENA_MAX, 1);
 
     for (int i = 0; i < 1; i++) {
         printf("===========================Test run %d ============================\n", i);
@@ -437,6 +972,16 @@ int main() {
         test_large_data();
         test_random_operations();
         test_thread_wakeup_order();
+        test_batch_operations();
+        test_multiple_instances();
+        test_bounded_queue();
+        test_timed_dequeue_and_shutdown();
+        test_priority_lanes();
+        test_thread_caches();
+        test_many_threads();
+#ifdef QUEUE_STATS
+        test_stats();
+#endif
         if (count_failed > 0) {
             break;
         }
@@ -449,4 +994,5 @@ int main() {
     }
     return 0;
 }
-//gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread queue.c test1.c -o test1
\ No newline at end of file
+//gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread queue.c test1.c -o test1
+//gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread -DQUEUE_STATS queue.c test1.c -o test1_stats
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "queue_sharded.h"
+
+int count_failed = 0;
+// Helper function to print test results
+void print_result(const char *test_name, bool result) {
+    printf("%s: %s\n", test_name, result ? "PASSED" : "FAILED");
+}
+
+// Function to test the sharded queue
+void test_sharded_queue() {
+    sharded_t *q = sharded_create();
+
+    // A thread takes its own items newest first, past the first array's size
+    for (long i = 1; i <= 100; ++i) {
+        sharded_enqueue(q, (void *)i);
+    }
+    bool own_order = sharded_size(q) == 100;
+    for (long i = 100; i >= 1; --i) {
+        void *item;
+        own_order = own_order && sharded_tryDequeue(q, &item) && (long)item == i;
+    }
+    void *item;
+    own_order = own_order && !sharded_tryDequeue(q, &item) && sharded_size(q) == 0 &&
+                sharded_visited(q) == 100;
+    print_result("Sharded Queue - Own items newest first", own_order);
+    if (!own_order) {
+        count_failed++;
+    }
+
+    // A sleeping thread steals the items of another thread's shard
+    long stolen[2];
+    int steal_thread(void *arg) {
+        (void)arg;
+        stolen[0] = (long)sharded_dequeue(q);
+        stolen[1] = (long)sharded_dequeue(q);
+        return 0;
+    }
+    thrd_t thief;
+    thrd_create(&thief, steal_thread, NULL);
+    thrd_sleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 50000000}, NULL);
+    sharded_enqueue(q, (void *)(long)1);
+    sharded_enqueue(q, (void *)(long)2);
+    thrd_join(thief, NULL);
+    bool steals = stolen[0] + stolen[1] == 3 && sharded_size(q) == 0 && sharded_visited(q) == 102;
+    print_result("Sharded Queue - Sleeping thread steals", steals);
+    if (!steals) {
+        count_failed++;
+    }
+
+    // Producers and consumers on their own shards lose and repeat no item
+    const int num_threads = 4;
+    const long per_thread = 20000;
+    atomic_long sum = 0;
+    int producer_thread(void *arg) {
+        for (long i = 0; i < per_thread; ++i) {
+            sharded_enqueue(q, (void *)((long)arg * per_thread + i + 1));
+        }
+        return 0;
+    }
+    int consumer_thread(void *arg) {
+        (void)arg;
+        for (long i = 0; i < per_thread; ++i) {
+            atomic_fetch_add(&sum, (long)sharded_dequeue(q));
+        }
+        return 0;
+    }
+    thrd_t producers[num_threads], consumers[num_threads];
+    for (int i = 0; i < num_threads; ++i) {
+        thrd_create(&consumers[i], consumer_thread, NULL);
+        thrd_create(&producers[i], producer_thread, (void *)(long)i);
+    }
+    for (int i = 0; i < num_threads; ++i) {
+        thrd_join(producers[i], NULL);
+        thrd_join(consumers[i], NULL);
+    }
+    long total = num_threads * per_thread;
+    bool all_taken = atomic_load(&sum) == total * (total + 1) / 2 && sharded_size(q) == 0 &&
+                     sharded_visited(q) == (size_t)(102 + total);
+    print_result("Sharded Queue - Every item dequeued once", all_taken);
+    if (!all_taken) {
+        count_failed++;
+    }
+
+    sharded_destroy(q);
+}
+
+// Function to test a thread that finds every shard id in use
+void test_shard_limit() {
+    sharded_t *q = sharded_create();
+    const int max_threads = 1100;
+    thrd_t holders[max_threads];
+    atomic_int started = 0;
+    atomic_bool refused = false;
+    bool stole = false;
+    bool open = false;
+    mtx_t gate;
+    cnd_t opened;
+    mtx_init(&gate, mtx_plain);
+    cnd_init(&opened);
+
+    // Every thread keeps its id until the gate opens, the first one without an id
+    // steals an item instead
+    int holder_thread(void *arg) {
+        (void)arg;
+        if (!sharded_enqueue(q, (void *)(long)1)) {
+            void *item;
+            stole = sharded_tryDequeue(q, &item) && (long)item == 1;
+            atomic_store(&refused, true);
+        }
+        atomic_fetch_add(&started, 1);
+        mtx_lock(&gate);
+        while (!open) {
+            cnd_wait(&opened, &gate);
+        }
+        mtx_unlock(&gate);
+        return 0;
+    }
+    int n = 0;
+    while (n < max_threads && !atomic_load(&refused)) {
+        if (thrd_create(&holders[n], holder_thread, NULL) != thrd_success) {
+            break;
+        }
+        n++;
+        while (atomic_load(&started) < n) {
+            thrd_yield();
+        }
+    }
+    bool limited = atomic_load(&refused) && stole && sharded_size(q) == (size_t)n - 2 &&
+                   sharded_visited(q) == 1;
+    print_result("Sharded Queue - Thread without a shard only steals", limited);
+    if (!limited) {
+        count_failed++;
+    }
+    mtx_lock(&gate);
+    open = true;
+    cnd_broadcast(&opened);
+    mtx_unlock(&gate);
+    for (int i = 0; i < n; ++i) {
+        thrd_join(holders[i], NULL);
+    }
+
+    // The ids of the finished threads are given back
+    bool enqueued = false;
+    int enqueue_thread(void *arg) {
+        (void)arg;
+        enqueued = sharded_enqueue(q, (void *)(long)1);
+        return 0;
+    }
+    thrd_t late;
+    thrd_create(&late, enqueue_thread, NULL);
+    thrd_join(late, NULL);
+    void *item;
+    size_t drained = 0;
+    while (sharded_tryDequeue(q, &item)) {
+        drained++;
+    }
+    bool reused = enqueued && drained == (size_t)n - 1 && sharded_size(q) == 0;
+    print_result("Sharded Queue - Ids are reused after threads exit", reused);
+    if (!reused) {
+        count_failed++;
+    }
+
+    mtx_destroy(&gate);
+    cnd_destroy(&opened);
+    sharded_destroy(q);
+}
+
+int main() {
+    test_sharded_queue();
+    test_shard_limit();
+    if (count_failed == 0) {
+        printf("All tests passed!\n");
+    } else {
+        printf("Some tests failed!\n");
+    }
+    return 0;
+}
+//gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread queue_sharded.c test_sharded.c -o test_sharded